@@ -35,6 +35,8 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
+#include <scstats.h>
 #include "opt-A2.h"
 
 /*
@@ -81,6 +83,14 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#ifdef UW
+	off_t pos;
+	int whence;
+	int fd;
+#endif
+#if OPT_SCSTATS
+	uint64_t scstart;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -99,6 +109,10 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
 
+#if OPT_SCSTATS
+	scstart = scstats_enter(callno);
+#endif
+
 	switch (callno) {
 	    case SYS_reboot:
 		err = sys_reboot(tf->tf_a0);
@@ -108,18 +122,153 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_futex_wait:
+		err = sys_futex_wait((userptr_t)tf->tf_a0,
+				     (int)tf->tf_a1);
+		break;
+
+	    case SYS_futex_wake:
+		err = sys_futex_wake((userptr_t)tf->tf_a0,
+				     (int)tf->tf_a1,
+				     &retval);
+		break;
 #ifdef UW
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
 			  (userptr_t)tf->tf_a1,
 			  (int)tf->tf_a2,
 			  (int *)(&retval));
 	  break;
+
+	case SYS_pread:
+	case SYS_pwrite:
+	  /* the 64-bit offset is 8-aligned, so it goes on the stack (a3 is padding) */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &pos, sizeof(off_t));
+	  if (err) {
+	    break;
+	  }
+	  if (callno == SYS_pread) {
+	    err = sys_pread((int)tf->tf_a0,
+			    (userptr_t)tf->tf_a1,
+			    (int)tf->tf_a2,
+			    pos,
+			    (int *)(&retval));
+	  }
+	  else {
+	    err = sys_pwrite((int)tf->tf_a0,
+			     (userptr_t)tf->tf_a1,
+			     (int)tf->tf_a2,
+			     pos,
+			     (int *)(&retval));
+	  }
+	  break;
+
+	case SYS_readv:
+	  err = sys_readv((int)tf->tf_a0,
+			  (const_userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2,
+			  (int *)(&retval));
+	  break;
+
+	case SYS_writev:
+	  err = sys_writev((int)tf->tf_a0,
+			   (const_userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int *)(&retval));
+	  break;
+
+	case SYS_sendfile:
+	  err = sys_sendfile((int)tf->tf_a0,
+			     (int)tf->tf_a1,
+			     (userptr_t)tf->tf_a2,
+			     (size_t)tf->tf_a3,
+			     (int *)(&retval));
+	  break;
+
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+
+	case SYS_lseek:
+	  /* the 64-bit offset is in a2/a3 (a1 is padding), whence on the stack */
+	  pos = ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3;
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &whence, sizeof(int));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_lseek((int)tf->tf_a0, pos, whence, &pos);
+	  if (!err) {
+	    /* 64-bit return value goes in v0 (high) and v1 (low) */
+	    retval = (int32_t)(pos >> 32);
+	    tf->tf_v1 = (uint32_t)pos;
+	  }
+	  break;
+
+	case SYS_sysring_enter:
+	  err = sys_sysring_enter((userptr_t)tf->tf_a0,
+				  (unsigned)tf->tf_a1,
+				  (int *)(&retval));
+	  break;
+
+	case SYS_fsync:
+	  err = sys_fsync((int)tf->tf_a0);
+	  break;
+
+	case SYS_mmap:
+	  /* fd is on the stack, then the 8-aligned 64-bit offset after it */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(int));
+	  if (err) {
+	    break;
+	  }
+	  err = copyin((const_userptr_t)(tf->tf_sp + 24), &pos, sizeof(off_t));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_mmap((userptr_t)tf->tf_a0,
+			 (size_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int)tf->tf_a3,
+			 fd,
+			 pos,
+			 (int *)(&retval));
+	  break;
+
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0,
+			   (size_t)tf->tf_a1);
+	  break;
+
+	case SYS_dup2:
+	  err = sys_dup2((int)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (int *)(&retval));
+	  break;
       
     #if OPT_A2  
     case SYS_fork:
       err = sys_fork((pid_t *)&retval, tf);
       break;
+
+    case SYS_spawn:
+      err = sys_spawn((userptr_t)tf->tf_a0,
+                      (userptr_t)tf->tf_a1,
+                      (pid_t *)&retval);
+      break;
     #endif
     
 	case SYS__exit:
@@ -155,6 +304,9 @@ syscall(struct trapframe *tf)
 	  break;
 	}
 
+#if OPT_SCSTATS
+	scstats_exit(callno, scstart, err);
+#endif
 
 	if (err) {
 		/*
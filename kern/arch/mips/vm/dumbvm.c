@@ -29,6 +29,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -37,6 +39,8 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <vnode.h>
 #include <coremapEtry.h>
 #include "opt-A3.h"
 
@@ -191,6 +195,347 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+////////////////////////////////////////////////////////////
+//
+// Mapped files.
+//
+// Pages are read in from the file on first touch. Pages of writeable
+// mappings are entered in the TLB read-only until they are written,
+// so that the resulting VM_FAULT_READONLY tells us they are dirty.
+
+static
+struct mmap_region *
+mmap_find(struct addrspace *as, vaddr_t vaddr)
+{
+	struct mmap_region *mr;
+
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (vaddr >= mr->mr_base &&
+		    vaddr < mr->mr_base + mr->mr_npages * PAGE_SIZE) {
+			return mr;
+		}
+	}
+	return NULL;
+}
+
+/* Drop the TLB entry for VADDR in the current address space, if any. */
+static
+void
+mmap_tlb_invalidate(vaddr_t vaddr)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(vaddr, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+static
+int
+mmap_pagein(struct mmap_region *mr, unsigned idx)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t kva;
+	int result;
+
+	kva = alloc_kpages(1);
+	if (kva == 0) {
+		return ENOMEM;
+	}
+	/* past end of file reads short and leaves zeros */
+	bzero((void *)kva, PAGE_SIZE);
+	uio_kinit(&iov, &u, (void *)kva, PAGE_SIZE,
+		  mr->mr_offset + (off_t)idx * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(mr->mr_vnode, &u);
+	if (result) {
+		free_kpages(kva);
+		return result;
+	}
+	mr->mr_pages[idx].mp_kvaddr = kva;
+	mr->mr_pages[idx].mp_dirty = false;
+	return 0;
+}
+
+static
+int
+mmap_fault(struct mmap_region *mr, int faulttype, vaddr_t faultaddress)
+{
+	struct mmap_page *mp;
+	unsigned idx;
+	uint32_t ehi, elo;
+	int i, spl, result;
+
+	if (faulttype != VM_FAULT_READ && !mr->mr_writeable) {
+		return EFAULT;
+	}
+
+	idx = (faultaddress - mr->mr_base) / PAGE_SIZE;
+	mp = &mr->mr_pages[idx];
+	if (mp->mp_kvaddr == 0) {
+		result = mmap_pagein(mr, idx);
+		if (result) {
+			return result;
+		}
+	}
+	if (faulttype != VM_FAULT_READ) {
+		mp->mp_dirty = true;
+	}
+
+	ehi = faultaddress;
+	elo = VADDR_TO_PVADDR(mp->mp_kvaddr) | TLBLO_VALID;
+	if (mp->mp_dirty) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+	}
+	else {
+		tlb_random(ehi, elo);
+	}
+	splx(spl);
+	return 0;
+}
+
+/*
+ * Write the dirty pages of a shared mapping back to the file. Mappings
+ * never extend the file, so anything past its end is dropped.
+ */
+static
+int
+mmap_writeback(struct addrspace *as, struct mmap_region *mr)
+{
+	struct mmap_page *mp;
+	struct stat st;
+	struct iovec iov;
+	struct uio u;
+	off_t pos;
+	size_t len;
+	unsigned i;
+	int result;
+
+	if (!mr->mr_shared) {
+		return 0;
+	}
+	result = VOP_STAT(mr->mr_vnode, &st);
+	if (result) {
+		return result;
+	}
+
+	for (i = 0; i < mr->mr_npages; i++) {
+		mp = &mr->mr_pages[i];
+		if (!mp->mp_dirty) {
+			continue;
+		}
+		/* read-only again, so the next write marks it dirty again */
+		if (as == curproc_getas()) {
+			mmap_tlb_invalidate(mr->mr_base + i * PAGE_SIZE);
+		}
+		mp->mp_dirty = false;
+
+		pos = mr->mr_offset + (off_t)i * PAGE_SIZE;
+		if (pos >= st.st_size) {
+			continue;
+		}
+		len = PAGE_SIZE;
+		if (st.st_size - pos < PAGE_SIZE) {
+			len = st.st_size - pos;
+		}
+		uio_kinit(&iov, &u, (void *)mp->mp_kvaddr, len, pos, UIO_WRITE);
+		result = VOP_WRITE(mr->mr_vnode, &u);
+		if (result) {
+			mp->mp_dirty = true;
+			return result;
+		}
+	}
+	return 0;
+}
+
+/* Free a mapping that has already been unlinked. Does not write back. */
+static
+void
+mmap_free(struct addrspace *as, struct mmap_region *mr)
+{
+	unsigned i;
+
+	for (i = 0; i < mr->mr_npages; i++) {
+		if (mr->mr_pages[i].mp_kvaddr != 0) {
+			if (as == curproc_getas()) {
+				mmap_tlb_invalidate(mr->mr_base + i * PAGE_SIZE);
+			}
+			free_kpages(mr->mr_pages[i].mp_kvaddr);
+		}
+	}
+	VOP_DECREF(mr->mr_vnode);
+	kfree(mr->mr_pages);
+	kfree(mr);
+}
+
+static
+struct mmap_region *
+mmap_create(size_t npages)
+{
+	struct mmap_region *mr;
+	size_t i;
+
+	mr = kmalloc(sizeof(*mr));
+	if (mr == NULL) {
+		return NULL;
+	}
+	mr->mr_pages = kmalloc(npages * sizeof(struct mmap_page));
+	if (mr->mr_pages == NULL) {
+		kfree(mr);
+		return NULL;
+	}
+	for (i = 0; i < npages; i++) {
+		mr->mr_pages[i].mp_kvaddr = 0;
+		mr->mr_pages[i].mp_dirty = false;
+	}
+	mr->mr_npages = npages;
+	mr->mr_next = NULL;
+	return mr;
+}
+
+/*
+ * Copy the mappings for fork. Resident pages are copied, so after fork
+ * a MAP_SHARED mapping is only shared through the file: each process
+ * sees the other's changes once they have been written back.
+ */
+static
+int
+mmap_copy(struct addrspace *old, struct addrspace *new)
+{
+	struct mmap_region *mr, *nmr, **tail;
+	size_t i;
+
+	tail = &new->as_mmaps;
+	for (mr = old->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		nmr = mmap_create(mr->mr_npages);
+		if (nmr == NULL) {
+			return ENOMEM;
+		}
+		nmr->mr_base = mr->mr_base;
+		nmr->mr_vnode = mr->mr_vnode;
+		VOP_INCREF(nmr->mr_vnode);
+		nmr->mr_offset = mr->mr_offset;
+		nmr->mr_writeable = mr->mr_writeable;
+		nmr->mr_shared = mr->mr_shared;
+		*tail = nmr;
+		tail = &nmr->mr_next;
+
+		for (i = 0; i < mr->mr_npages; i++) {
+			if (mr->mr_pages[i].mp_kvaddr == 0) {
+				continue;
+			}
+			nmr->mr_pages[i].mp_kvaddr = alloc_kpages(1);
+			if (nmr->mr_pages[i].mp_kvaddr == 0) {
+				return ENOMEM;
+			}
+			memmove((void *)nmr->mr_pages[i].mp_kvaddr,
+				(const void *)mr->mr_pages[i].mp_kvaddr,
+				PAGE_SIZE);
+			nmr->mr_pages[i].mp_dirty = mr->mr_pages[i].mp_dirty;
+		}
+	}
+	new->as_mmaptop = old->as_mmaptop;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *vn, off_t offset, size_t len,
+	int prot, int flags, vaddr_t *ret)
+{
+	struct mmap_region *mr;
+	vaddr_t limit, top;
+	size_t npages;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	/* Mappings go between the regions and the stack, top down. */
+	limit = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	top = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	if (top > limit) {
+		limit = top;
+	}
+	limit += PAGE_SIZE;
+	if (as->as_mmaptop <= limit ||
+	    len > as->as_mmaptop - limit) {
+		return ENOMEM;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	mr = mmap_create(npages);
+	if (mr == NULL) {
+		return ENOMEM;
+	}
+	mr->mr_base = as->as_mmaptop - npages * PAGE_SIZE;
+	mr->mr_vnode = vn;
+	VOP_INCREF(vn);
+	mr->mr_offset = offset;
+	mr->mr_writeable = (prot & PROT_WRITE) != 0;
+	mr->mr_shared = (flags & MAP_SHARED) != 0;
+	mr->mr_next = as->as_mmaps;
+	as->as_mmaps = mr;
+
+	/* leave an unmapped guard page below each mapping */
+	as->as_mmaptop = mr->mr_base - PAGE_SIZE;
+
+	*ret = mr->mr_base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct mmap_region *mr, **pp;
+	int result;
+
+	for (pp = &as->as_mmaps; *pp != NULL; pp = &(*pp)->mr_next) {
+		if ((*pp)->mr_base == addr) {
+			break;
+		}
+	}
+	mr = *pp;
+	/* Only whole mappings can be removed. */
+	if (mr == NULL || DIVROUNDUP(len, PAGE_SIZE) != mr->mr_npages) {
+		return EINVAL;
+	}
+
+	result = mmap_writeback(as, mr);
+	if (result) {
+		return result;
+	}
+	*pp = mr->mr_next;
+	mmap_free(as, mr);
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, struct vnode *vn)
+{
+	struct mmap_region *mr;
+	int result;
+
+	for (mr = as->as_mmaps; mr != NULL; mr = mr->mr_next) {
+		if (vn == NULL || mr->mr_vnode == vn) {
+			result = mmap_writeback(as, mr);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
 static
 paddr_t get_paddr(vaddr_t vaddr, struct pagetableEtry* ptb, vaddr_t vbase, size_t npages) {
     vaddr_t vlookfor = vaddr - vbase;
@@ -208,6 +553,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
+	struct mmap_region *mr;
 	int spl;
 
 	faultaddress &= PAGE_FRAME;
@@ -216,12 +562,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-            #if OPT_A3
-            return 1;
-            #else
-            /* We always create pages read-write, so we can't get this */
-            panic("dumbvm: got VM_FAULT_READONLY\n");
-            #endif
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -247,6 +587,21 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+	/* Mapped files do their own thing, including read-only faults. */
+	mr = mmap_find(as, faultaddress);
+	if (mr != NULL) {
+		return mmap_fault(mr, faulttype, faultaddress);
+	}
+
+	if (faulttype == VM_FAULT_READONLY) {
+            #if OPT_A3
+            return 1;
+            #else
+            /* We always create pages read-write, so we can't get this */
+            panic("dumbvm: got VM_FAULT_READONLY\n");
+            #endif
+	}
+
 	/* Assert that the address space has been set up properly. 
 	KASSERT(as->as_vbase1 != 0);
 	KASSERT(as->as_ptable1 != 0);
@@ -327,6 +682,8 @@ as_create(void)
 	as->as_npages2 = 0;
 	as->as_stack = 0;
     as->readonlyON = false;
+	as->as_mmaps = NULL;
+	as->as_mmaptop = USERSTACK - (DUMBVM_STACKPAGES + 1) * PAGE_SIZE;
 
 	return as;
 }
@@ -334,6 +691,16 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	struct mmap_region *mr;
+
+	/* Write back shared mappings; there is nobody to report errors to. */
+	while (as->as_mmaps != NULL) {
+		mr = as->as_mmaps;
+		as->as_mmaps = mr->mr_next;
+		(void)mmap_writeback(as, mr);
+		mmap_free(as, mr);
+	}
+
     for(size_t i=0; i<as->as_npages1; i++) {
         free_kpages(as->as_ptable1[i].paddr);
     }
@@ -555,6 +922,10 @@ as_copy(struct addrspace *old, struct addrspace **ret)
             PAGE_SIZE);
     }
 
+	if (mmap_copy(old, new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
 	
 	*ret = new;
 	return 0;
@@ -36,11 +36,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -71,26 +72,36 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
 	uint32_t j, mapsize;
 	char *bitdata;
+	const char *cbitdata;
 	int result;
 
 	/* Number of blocks in the bitmap. */
 	mapsize = SFS_FS_BITBLOCKS(sfs);
 
-	/* Pointer to our bitmap data in memory. */
-	bitdata = bitmap_getdata(sfs->sfs_freemap);
+	/*
+	 * Pointer to our bitmap data in memory. Only reading changes
+	 * the bits, so only then does the bitmap need to know.
+	 */
+	if (rw == UIO_READ) {
+		bitdata = bitmap_getdata(sfs->sfs_freemap);
+		cbitdata = bitdata;
+	}
+	else {
+		bitdata = NULL;
+		cbitdata = bitmap_getdata_const(sfs->sfs_freemap);
+	}
 	
 	/* For each sector in the bitmap... */
 	for (j=0; j<mapsize; j++) {
 
-		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
-
-		/* and read or write it. The bitmap starts at sector 2. */ 
+		/* read or write it. The bitmap starts at sector 2. */ 
 		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_rblock(sfs, bitdata + j*SFS_BLOCKSIZE,
+					    SFS_MAP_LOCATION+j);
 		}
 		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			result = sfs_wblock(sfs, cbitdata + j*SFS_BLOCKSIZE,
+					    SFS_MAP_LOCATION+j);
 		}
 
 		/* If we failed, stop. */
@@ -101,6 +112,44 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Write out the free block map and the superblock if they've changed,
+ * and then everything dirty in the buffer cache.
+ */
+static
+int
+sfs_sync_meta(struct sfs_fs *sfs)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	/* If the free block map needs to be written, write it. */
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_freemapdirty = false;
+	}
+
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		sfs->sfs_superdirty = false;
+	}
+
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Push out everything, once for the whole device. */
+	return buffer_sync_dev(sfs->sfs_device);
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,10 +160,9 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct sfs_vnode *sv, **svs;
 	unsigned i, num;
-	int result;
-
-	vfs_biglock_acquire();
+	int result, err;
 
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
@@ -148,35 +196,50 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/*
+	 * Collect the loaded vnodes, with a reference on each so they
+	 * stay loaded. The vnode locks come before the table lock, so
+	 * they can't be taken while walking the table.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	svs = NULL;
+	if (num > 0) {
+		svs = kmalloc(num * sizeof(*svs));
+		if (svs == NULL) {
+			lock_release(sfs->sfs_vnlock);
+			return ENOMEM;
+		}
 	}
-
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+	num = 0;
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			KASSERT(num < sfs->sfs_nvnodes);
+			VOP_INCREF(&sv->sv_v);
+			svs[num++] = sv;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_vnlock);
 
-	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+	/* Write their inodes into the buffer cache. */
+	result = 0;
+	for (i=0; i<num; i++) {
+		lock_acquire(svs[i]->sv_lock);
+		err = sfs_sync_inode(svs[i]);
+		lock_release(svs[i]->sv_lock);
+		if (err && result == 0) {
+			result = err;
 		}
-		sfs->sfs_superdirty = false;
+		VOP_DECREF(&svs[i]->sv_v);
+	}
+	if (svs != NULL) {
+		kfree(svs);
+	}
+	if (result) {
+		return result;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	return sfs_sync_meta(sfs);
 }
 
 /*
@@ -189,13 +252,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* Never changes while mounted, so no lock needed. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,31 +267,46 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. Nobody can
+	 * get at the filesystem without a vnode, and a reclaim does
+	 * all its work on the filesystem before taking its vnode out
+	 * of the table, so once the table is empty nothing else is
+	 * going on.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 
-	/* We should have just had sfs_sync called. */
+	/*
+	 * We just had sfs_sync called, but vnodes reclaimed since then
+	 * may have changed things again.
+	 */
+	result = sfs_sync_meta(sfs);
+	lock_release(sfs->sfs_vnlock);
+	if (result) {
+		return result;
+	}
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
+	buffer_drop_dev(sfs->sfs_device);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
 	/* Destroy the fs object */
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -256,8 +330,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
 	struct sfs_fs *sfs;
-
-	vfs_biglock_acquire();
+	unsigned i;
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -278,24 +351,20 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+	/* No vnodes loaded yet */
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
@@ -303,9 +372,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,9 +383,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_dev(dev);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
@@ -333,20 +399,35 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_dev(dev);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		buffer_drop_dev(dev);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* Locks */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		buffer_drop_dev(dev);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		bitmap_destroy(sfs->sfs_freemap);
+		buffer_drop_dev(dev);
+		kfree(sfs);
+		return ENOMEM;
+	}
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
@@ -357,11 +438,11 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* the other fields */
 	sfs->sfs_superdirty = false;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_allochint = 0;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
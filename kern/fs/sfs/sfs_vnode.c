@@ -37,18 +37,31 @@
 #include <kern/fcntl.h>
 #include <stat.h>
 #include <lib.h>
-#include <array.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
+/* Read-ahead window limits, in blocks. */
+#define SFS_RA_MIN  4
+#define SFS_RA_MAX  64
+
+/* Directory entries per block, which is also the size of a hash bucket. */
+#define SFS_DIRPERBLOCK  ((int)(SFS_BLOCKSIZE / sizeof(struct sfs_dir)))
+
+/* Linear directories are converted to hashed past this many slots. */
+#define SFS_DIRHASH_MIN  SFS_DIRPERBLOCK
+
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With the vnode ops */
+static int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,13 +71,22 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buffer_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(b), SFS_BLOCKSIZE);
+	sfs_writebuf(b);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
-static
+/*
+ * Write an on-disk inode structure back out to disk (or at least to
+ * the buffer cache). Must hold sv_lock.
+ */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
@@ -84,16 +106,23 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block, the first free one at or after GOAL. Remember
+ * where it was, for allocations that don't have a goal of their own;
+ * a GOAL of 0 (the superblock, never free) means to use that.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (goal == 0) {
+		goal = sfs->sfs_allochint;
+	}
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
@@ -101,20 +130,48 @@ sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
+	sfs->sfs_allochint = *diskblock + 1;
+	lock_release(sfs->sfs_freemaplock);
 
-	/* Clear block before returning it */
+	/* Clear block before returning it. It's ours, so no lock needed. */
 	return sfs_clearblock(sfs, *diskblock);
 }
 
 /*
- * Free a block.
+ * Allocate a block for a file, as soon after the last one allocated
+ * for it as possible, so that a file written in order is laid out in
+ * order on disk. The first one goes right after the inode.
+ */
+static
+int
+sfs_balloc_file(struct sfs_vnode *sv, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t goal;
+	int result;
+
+	goal = sv->sv_allocnext != 0 ? sv->sv_allocnext : sv->sv_ino + 1;
+	result = sfs_balloc(sfs, goal, diskblock);
+	if (result) {
+		return result;
+	}
+	sv->sv_allocnext = *diskblock + 1;
+	return 0;
+}
+
+/*
+ * Free a block. Whatever is cached for it is thrown away, so that
+ * dirty contents don't get written out for nothing.
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	buffer_drop(sfs->sfs_device, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,17 +181,139 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/* Number of levels of indirect blocks. */
+#define SFS_NINDIRECT  3
+
+/*
+ * Get the inode field holding the indirect block with DEPTH levels of
+ * indirection under it: the single, double, or triple indirect block.
+ */
+static
+uint32_t *
+sfs_inode_indirect(struct sfs_vnode *sv, int depth)
+{
+	switch (depth) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: Invalid indirection depth %d\n", depth);
+	return NULL;
+}
+
+/*
+ * Look up block OFFSET of the part of a file mapped by an indirect
+ * block with DEPTH levels of indirection, whose number is in the inode
+ * at *IDPTR. If DOALLOC is set, allocate whatever is missing on the
+ * way down; otherwise a missing block anywhere means the block is a
+ * hole, and 0 is handed back.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t *idptr, int depth,
+		  uint32_t offset, int doalloc, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t block, span, idoff;
+	int result;
+
+	/* Get the disk block number of the top indirect block. */
+	block = *idptr;
+
+	if (block==0 && !doalloc) {
+		/*
+		 * There's no indirect block allocated. We weren't
+		 * asked to allocate anything, so pretend the indirect
+		 * block was filled with all zeros.
+		 */
+		*diskblock = 0;
+		return 0;
+	}
+	else if (block==0) {
+		/*
+		 * There's no indirect block allocated, but we need to
+		 * allocate a block whose number needs to be stored in
+		 * the indirect block. Thus, we need to allocate an
+		 * indirect block. sfs_balloc clears it for us.
+		 */
+		result = sfs_balloc_file(sv, &block);
+		if (result) {
+			return result;
+		}
+
+		/* Remember the block we just allocated; mark inode dirty */
+		*idptr = block;
+		sv->sv_dirty = true;
+	}
+
+	/* Number of file blocks under each entry of the top block */
+	span = 1;
+	while (--depth > 0) {
+		span *= SFS_DBPERIDB;
+	}
+
+	/* Walk down, one indirect block at a time. */
+	while (span > 0) {
+		idoff = offset / span;
+		offset %= span;
+
+		/* Load the indirect block. */
+		result = buffer_read(sfs->sfs_device, block, &idbuf);
+		if (result) {
+			return result;
+		}
+		iddata = buffer_map(idbuf);
+
+		/* Get the next block out of the indirect block */
+		block = iddata[idoff];
+
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			result = sfs_balloc_file(sv, &block);
+			if (result) {
+				buffer_release(idbuf);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			iddata[idoff] = block;
+
+			/* The indirect block is now dirty */
+			sfs_writebuf(idbuf);
+		}
+		else {
+			buffer_release(idbuf);
+		}
+
+		if (block == 0) {
+			/* A hole */
+			break;
+		}
+		span /= SFS_DBPERIDB;
+	}
+
+	*diskblock = block;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -146,22 +325,23 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t offset, span;
+	int depth;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	/*
+	 * If it's in the last run of blocks we found to be contiguous
+	 * on disk, we don't need to look at the inode or the indirect
+	 * blocks at all.
+	 */
+	if (fileblock - sv->sv_extfile < sv->sv_extlen) {
+		*diskblock = sv->sv_extdisk + (fileblock - sv->sv_extfile);
+		return 0;
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +356,7 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc_file(sv, &block);
 			if (result) {
 				return result;
 			}
@@ -185,106 +365,56 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 			sv->sv_i.sfi_direct[fileblock] = block;
 			sv->sv_dirty = true;
 		}
-
-		/*
-		 * Hand back the block
-		 */
-		if (block != 0 && !sfs_bused(sfs, block)) {
-			panic("sfs: Data block %u (block %u of file %u) "
-			      "marked free\n", block, fileblock, sv->sv_ino);
-		}
-		*diskblock = block;
-		return 0;
-	}
-
-	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
-		return EFBIG;
-	}
-
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
-	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
-		}
-
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
-
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
 	else {
 		/*
-		 * We already have an indirect block allocated; load it.
+		 * It's not a direct block; find which of the indirect
+		 * blocks it's under, and where. OFFSET is the offset
+		 * into the space mapped by that indirect block.
 		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		offset = fileblock - SFS_NDIRECT;
+		span = SFS_DBPERIDB;
+		for (depth=1; depth<=SFS_NINDIRECT; depth++) {
+			if (offset < span) {
+				break;
+			}
+			offset -= span;
+			span *= SFS_DBPERIDB;
 		}
-	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+		/* If the offset is past even the triple indirect block, fail. */
+		if (depth > SFS_NINDIRECT) {
+			return EFBIG;
 		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+		result = sfs_bmap_indirect(sv, sfs_inode_indirect(sv, depth),
+					   depth, offset, doalloc, &block);
 		if (result) {
 			return result;
 		}
 	}
 
-	/* Hand back the result and return. */
+	/*
+	 * Hand back the block
+	 */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
 		      block, fileblock, sv->sv_ino);
 	}
+
+	/* Extend the run of contiguous blocks, or start a new one. */
+	if (block != 0) {
+		if (fileblock == sv->sv_extfile + sv->sv_extlen &&
+		    block == sv->sv_extdisk + sv->sv_extlen) {
+			sv->sv_extlen++;
+		}
+		else {
+			sv->sv_extfile = fileblock;
+			sv->sv_extdisk = block;
+			sv->sv_extlen = 1;
+		}
+	}
+
 	*diskblock = block;
 	return 0;
 }
@@ -293,6 +423,29 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 //
 // File-level I/O
 
+/*
+ * Copy LEN bytes between the bounce buffer KBUF and UIO. Must hold
+ * sv_lock. User memory may be a mapped file, this one or another,
+ * whose page-in reads through VOP_READ, so the lock is let go while
+ * copying to or from it. Kernel memory can't fault that way, and
+ * keeping the lock keeps directory operations atomic.
+ */
+static
+int
+sfs_uiomove(struct sfs_vnode *sv, void *kbuf, size_t len, struct uio *uio)
+{
+	int result;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return uiomove(kbuf, len, uio);
+	}
+
+	lock_release(sv->sv_lock);
+	result = uiomove(kbuf, len, uio);
+	lock_acquire(sv->sv_lock);
+	return result;
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -302,36 +455,59 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
  * skipstart is the number of bytes to skip past at the beginning of
  * the sector; len is the number of bytes to actually read or write.
  * uio is the area to do the I/O into.
+ *
+ * The data goes through KBUF, a block-sized bounce buffer, so that
+ * no buffer is pinned while copying to or from the uio. User memory
+ * may be a mapped file whose page-in needs this very block. The copy
+ * may also let go of sv_lock (see sfs_uiomove), so a write copies in
+ * before looking at the file at all.
  */
 static
 int
-sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
+sfs_partialio(struct sfs_vnode *sv, struct uio *uio, char *kbuf,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
-	int result;
-	
-	/* Allocate missing blocks if and only if we're writing */
-	int doalloc = (uio->uio_rw==UIO_WRITE);
+	size_t moved;
+	int result, result2;
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
+	if (uio->uio_rw == UIO_WRITE) {
+		/*
+		 * Get the data first. If the copy only got partway,
+		 * write what it did get, since that much of the uio
+		 * has been used up.
+		 */
+		moved = uio->uio_resid;
+		result = sfs_uiomove(sv, kbuf, len, uio);
+		moved -= uio->uio_resid;
+		if (moved == 0) {
+			return result;
+		}
+
+		/* Get the disk block number, allocating if needed */
+		result2 = sfs_bmap(sv, fileblock, 1, &diskblock);
+		if (result2) {
+			return result2;
+		}
+		result2 = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+		if (result2) {
+			return result2;
+		}
+		memcpy((char *)buffer_map(iobuf)+skipstart, kbuf, moved);
+		sfs_writebuf(iobuf);
+		return result;
+	}
+
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -339,109 +515,168 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
+		 * Read zeros.
 		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		bzero(kbuf, len);
+		return sfs_uiomove(sv, kbuf, len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block, and let go of it before copying out.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
 	if (result) {
 		return result;
 	}
+	memcpy(kbuf, (char *)buffer_map(iobuf)+skipstart, len);
+	buffer_release(iobuf);
 
-	/*
-	 * If it was a write, write back the modified block.
-	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
-	}
-
-	return 0;
+	return sfs_uiomove(sv, kbuf, len, uio);
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of a single whole block, through
+ * KBUF as in sfs_partialio.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, char *kbuf)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
-	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	size_t moved;
+	int result, result2;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+
+	if (uio->uio_rw == UIO_WRITE) {
+		/* As in sfs_partialio, a partial copy is still written. */
+		moved = uio->uio_resid;
+		result = sfs_uiomove(sv, kbuf, SFS_BLOCKSIZE, uio);
+		moved -= uio->uio_resid;
+		if (moved == 0) {
+			return result;
+		}
+
+		/* Look up the disk block number, allocating if needed */
+		result2 = sfs_bmap(sv, fileblock, 1, &diskblock);
+		if (result2) {
+			return result2;
+		}
+
+		/*
+		 * Get the block from the buffer cache. A write of the
+		 * whole block replaces it, so there's no need to read
+		 * it first.
+		 */
+		if (moved == SFS_BLOCKSIZE) {
+			result2 = buffer_get(sfs->sfs_device, diskblock,
+					     &iobuf);
+		}
+		else {
+			result2 = buffer_read(sfs->sfs_device, diskblock,
+					      &iobuf);
+		}
+		if (result2) {
+			return result2;
+		}
+		memcpy(buffer_map(iobuf), kbuf, moved);
+		sfs_writebuf(iobuf);
+		return result;
+	}
+
 	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
 
 	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		/* No block - fill with zeros. */
+		bzero(kbuf, SFS_BLOCKSIZE);
+		return sfs_uiomove(sv, kbuf, SFS_BLOCKSIZE, uio);
 	}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	result = buffer_read(sfs->sfs_device, diskblock, &iobuf);
+	if (result) {
+		return result;
+	}
+	memcpy(kbuf, buffer_map(iobuf), SFS_BLOCKSIZE);
+	buffer_release(iobuf);
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	return sfs_uiomove(sv, kbuf, SFS_BLOCKSIZE, uio);
+}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+/*
+ * Called before a read. If it picks up where the last read left off,
+ * ask the buffer cache to start reading the blocks after it, so they're
+ * there by the time they're wanted. The window starts at SFS_RA_MIN
+ * blocks and doubles with each further sequential read, up to
+ * SFS_RA_MAX; any other read turns read-ahead off until the pattern is
+ * sequential again.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t first, last, start, end, nblocks, fileblock, diskblock;
 
-	return result;
+	KASSERT(uio->uio_resid > 0);
+	first = uio->uio_offset / SFS_BLOCKSIZE;
+	last = (uio->uio_offset + uio->uio_resid - 1) / SFS_BLOCKSIZE;
+
+	/* Continuing in the block the last read ended in also counts. */
+	if (first == sv->sv_ranext || first + 1 == sv->sv_ranext) {
+		if (sv->sv_rawin == 0) {
+			sv->sv_rawin = SFS_RA_MIN;
+		}
+		else if (sv->sv_rawin < SFS_RA_MAX) {
+			sv->sv_rawin *= 2;
+		}
+	}
+	else {
+		sv->sv_rawin = 0;
+		sv->sv_raend = 0;
+	}
+	sv->sv_ranext = last + 1;
+
+	if (sv->sv_rawin == 0) {
+		return;
+	}
+
+	start = last + 1;
+	if (start < sv->sv_raend) {
+		start = sv->sv_raend;
+	}
+	end = last + 1 + sv->sv_rawin;
+	nblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (end > nblocks) {
+		end = nblocks;
+	}
+
+	for (fileblock = start; fileblock < end; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buffer_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	if (end > sv->sv_raend) {
+		sv->sv_raend = end;
+	}
 }
 
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
+ * Must hold sv_lock. For user memory the lock is let go between blocks,
+ * so others may see a large read or write partly done.
  */
 static
 int
@@ -451,6 +686,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
+	off_t done;
+	char *kbuf;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -471,8 +708,21 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		if (uio->uio_resid > 0) {
+			sfs_readahead(sv, uio);
+		}
+	}
+
+	kbuf = kmalloc(SFS_BLOCKSIZE);
+	if (kbuf == NULL) {
+		uio->uio_resid += extraresid;
+		return ENOMEM;
 	}
 
+	/* End of what has been written successfully */
+	done = uio->uio_offset;
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -490,10 +740,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 
 		/* Call sfs_partialio() to do it. */
-		result = sfs_partialio(sv, uio, skip, len);
+		result = sfs_partialio(sv, uio, kbuf, skip, len);
 		if (result) {
 			goto out;
 		}
+		done = uio->uio_offset;
 	}
 
 	/* If we're done, quit. */
@@ -507,10 +758,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
 	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+		result = sfs_blockio(sv, uio, kbuf);
 		if (result) {
 			goto out;
 		}
+		done = uio->uio_offset;
 	}
 
 	/*
@@ -519,18 +771,23 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
 
 	if (uio->uio_resid > 0) {
-		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
+		result = sfs_partialio(sv, uio, kbuf, 0, uio->uio_resid);
 		if (result) {
 			goto out;
 		}
+		done = uio->uio_offset;
 	}
 
  out:
+	kfree(kbuf);
 
-	/* If writing, adjust file length */
+	/*
+	 * If writing, adjust file length. Only count what made it into
+	 * the file; a failed block may have used up uio space without.
+	 */
 	if (uio->uio_rw == UIO_WRITE && 
-	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
-		sv->sv_i.sfi_size = uio->uio_offset;
+	    done > (off_t)sv->sv_i.sfi_size) {
+		sv->sv_i.sfi_size = done;
 		sv->sv_dirty = true;
 	}
 
@@ -637,23 +894,37 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Hash a name for a hashed directory. This is part of the on-disk
+ * format; see kern/sfs.h.
  */
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
 
+	while (*name != 0) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Search slots FIRST through LAST-1 of a directory for a filename, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty slot among them if one is found.
+ */
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_scan(struct sfs_vnode *sv, const char *name, int first, int last,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_dir tsd;
-	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
 	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	for (i=first; i<last; i++) {
 
 		/* Read the entry from that slot */
 		result = sfs_readdir(sv, &tsd, i);
@@ -670,22 +941,203 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 			/* Ensure null termination, just in case */
 			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
 			if (!strcmp(tsd.sfd_name, name)) {
-
-				/* Each name may legally appear only once... */
-				KASSERT(found==0);
-
-				found = 1;
+				/* Each name may legally appear only once. */
 				if (slot != NULL) {
 					*slot = i;
 				}
 				if (ino != NULL) {
 					*ino = tsd.sfd_ino;
 				}
+				return 0;
+			}
+		}
+	}
+
+	return ENOENT;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found. In a hashed directory the
+ * name's own bucket is searched, and then the overflow slots past the
+ * buckets, if any; an empty slot in the bucket is preferred.
+ */
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	uint32_t nbuckets;
+	int nentries, first, bempty, oempty;
+	int result;
+
+	nentries = sfs_dir_nentries(sv);
+	nbuckets = sv->sv_i.sfi_dirbuckets;
+	if (nbuckets == 0) {
+		return sfs_dir_scan(sv, name, 0, nentries,
+				    ino, slot, emptyslot);
+	}
+	KASSERT((int)nbuckets * SFS_DIRPERBLOCK <= nentries);
+
+	bempty = oempty = -1;
+	first = (sfs_dir_hash(name) % nbuckets) * SFS_DIRPERBLOCK;
+	result = sfs_dir_scan(sv, name, first, first + SFS_DIRPERBLOCK,
+			      ino, slot, &bempty);
+	if (result == ENOENT) {
+		result = sfs_dir_scan(sv, name,
+				      nbuckets * SFS_DIRPERBLOCK, nentries,
+				      ino, slot, &oempty);
+	}
+	if (result == ENOENT && emptyslot != NULL) {
+		if (bempty >= 0) {
+			*emptyslot = bempty;
+		}
+		else if (oempty >= 0) {
+			*emptyslot = oempty;
+		}
+	}
+	return result;
+}
+
+/*
+ * Rebuild a directory as a hashed directory of at least MINBUCKETS
+ * buckets, and preferably with room in the right bucket to add NAME.
+ * This converts a linear directory, or grows a hashed one.
+ *
+ * There are never more than SFS_DIRBUCKETS_MAX buckets. Names whose
+ * bucket is full go in overflow slots after the last bucket, so the
+ * layout never limits how many names a directory can hold.
+ *
+ * The directory is never made shorter, so that it needn't be
+ * truncated, and it is first extended with empty slots, so that
+ * rewriting it in place can't run out of space half way.
+ */
+static
+int
+sfs_dir_rehash(struct sfs_vnode *sv, uint32_t minbuckets, const char *name)
+{
+	struct sfs_dir *old, *new;
+	uint8_t *counts;
+	struct iovec iov;
+	struct uio ku;
+	uint32_t nbuckets, bucket;
+	int nslots, nlive, newslots, overflow, i, j;
+	bool fits;
+	int result;
+
+	/* Gather up the live entries. */
+	nslots = sfs_dir_nentries(sv);
+	old = kmalloc((nslots + 1) * sizeof(*old));
+	if (old == NULL) {
+		return ENOMEM;
+	}
+	nlive = 0;
+	for (i=0; i<nslots; i++) {
+		result = sfs_readdir(sv, &old[nlive], i);
+		if (result) {
+			kfree(old);
+			return result;
+		}
+		if (old[nlive].sfd_ino != SFS_NOINO) {
+			old[nlive].sfd_name[SFS_NAMELEN-1] = 0;
+			nlive++;
+		}
+	}
+
+	/*
+	 * Start at most half full, counting the new name, and covering
+	 * the slots there are already, and keep doubling until no
+	 * bucket overflows or there are as many buckets as allowed.
+	 */
+	nbuckets = minbuckets < 2 ? 2 : minbuckets;
+	while (nbuckets < SFS_DIRBUCKETS_MAX &&
+	       (nbuckets * SFS_DIRPERBLOCK < 2 * (uint32_t)(nlive + 1) ||
+		nbuckets * SFS_DIRPERBLOCK < (uint32_t)nslots)) {
+		nbuckets *= 2;
+	}
+	while (nbuckets < SFS_DIRBUCKETS_MAX) {
+		counts = kmalloc(nbuckets);
+		if (counts == NULL) {
+			kfree(old);
+			return ENOMEM;
+		}
+		bzero(counts, nbuckets);
+		fits = ++counts[sfs_dir_hash(name) % nbuckets] <= SFS_DIRPERBLOCK;
+		for (i=0; i<nlive && fits; i++) {
+			bucket = sfs_dir_hash(old[i].sfd_name) % nbuckets;
+			fits = ++counts[bucket] <= SFS_DIRPERBLOCK;
+		}
+		kfree(counts);
+		if (fits) {
+			break;
+		}
+		nbuckets *= 2;
+	}
+	if (nbuckets > SFS_DIRBUCKETS_MAX) {
+		nbuckets = SFS_DIRBUCKETS_MAX;
+	}
+
+	/* Room for every name to overflow, as a bound. */
+	newslots = nbuckets * SFS_DIRPERBLOCK + nlive;
+	if (newslots < nslots) {
+		newslots = nslots;
+	}
+	new = kmalloc(newslots * sizeof(*new));
+	if (new == NULL) {
+		kfree(old);
+		return ENOMEM;
+	}
+	bzero(new, newslots * sizeof(*new));
+
+	/*
+	 * Put each entry in the first free slot of its bucket, or if
+	 * that's full, in the next overflow slot.
+	 */
+	overflow = nbuckets * SFS_DIRPERBLOCK;
+	for (i=0; i<nlive; i++) {
+		j = (sfs_dir_hash(old[i].sfd_name) % nbuckets) *
+			SFS_DIRPERBLOCK;
+		for (bucket=0; bucket<SFS_DIRPERBLOCK; bucket++, j++) {
+			if (new[j].sfd_ino == SFS_NOINO) {
+				break;
 			}
 		}
+		if (bucket == SFS_DIRPERBLOCK) {
+			j = overflow++;
+		}
+		new[j] = old[i];
 	}
+	newslots = overflow > nslots ? overflow : nslots;
 
-	return found ? 0 : ENOENT;
+	/* Extend with empty slots; harmless if it fails part way. */
+	if (newslots > nslots) {
+		uio_kinit(&iov, &ku, &new[nslots],
+			  (newslots - nslots) * sizeof(*new),
+			  nslots * sizeof(*new), UIO_WRITE);
+		result = sfs_io(sv, &ku);
+		if (result) {
+			kfree(new);
+			kfree(old);
+			return result;
+		}
+	}
+
+	/* Write it all back; everything is allocated now. */
+	uio_kinit(&iov, &ku, new, newslots * sizeof(*new), 0, UIO_WRITE);
+	result = sfs_io(sv, &ku);
+	if (result == 0) {
+		sv->sv_i.sfi_dirbuckets = nbuckets;
+		sv->sv_dirty = true;
+	}
+	else {
+		kprintf("sfs: directory %u: rehash failed: %s\n",
+			sv->sv_ino, strerror(result));
+	}
+
+	kfree(new);
+	kfree(old);
+	return result;
 }
 
 /*
@@ -697,6 +1149,7 @@ int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
 	int emptyslot = -1;
+	uint32_t nbuckets;
 	int result;
 	struct sfs_dir sd;
 
@@ -713,7 +1166,33 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/*
+	 * If we didn't get an empty slot, make room. A small linear
+	 * directory just gets longer; past SFS_DIRHASH_MIN slots it is
+	 * converted to a hashed one, and a hashed one whose bucket is
+	 * full doubles, up to SFS_DIRBUCKETS_MAX buckets. After that,
+	 * or if there's no memory to rebuild it, the name goes in a new
+	 * slot at the end, which in a hashed directory is an overflow
+	 * slot.
+	 */
+	nbuckets = sv->sv_i.sfi_dirbuckets;
+	if (emptyslot < 0 && nbuckets == 0 &&
+	    sfs_dir_nentries(sv) < SFS_DIRHASH_MIN) {
+		emptyslot = sfs_dir_nentries(sv);
+	}
+	if (emptyslot < 0 && nbuckets < SFS_DIRBUCKETS_MAX) {
+		result = sfs_dir_rehash(sv, nbuckets * 2, name);
+		if (result == 0) {
+			result = sfs_dir_findname(sv, name, NULL, NULL,
+						  &emptyslot);
+			if (result!=0 && result!=ENOENT) {
+				return result;
+			}
+		}
+		else if (result != ENOMEM) {
+			return result;
+		}
+	}
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
 	}
@@ -798,10 +1277,12 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode 
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) Put it
+	 * after whatever was allocated last, rather than in the first
+	 * hole, so the file's blocks can follow it.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -870,13 +1351,23 @@ sfs_opendir(struct vnode *v, int openflags)
  *
  * This function should attempt to avoid returning errors, as handling
  * them usefully is often not possible.
+ *
+ * Only the inode is synced, and only into the buffer cache; the file's
+ * blocks reach the disk with the rest of the dirty buffers. Use fsync
+ * to wait for them.
  */
 static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -890,31 +1381,16 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **svp;
 	int result;
 
-	vfs_biglock_acquire();
-
-	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
-	 */
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		vfs_biglock_release();
-		return EBUSY;
-	}
+	lock_acquire(sv->sv_lock);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
@@ -922,35 +1398,60 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. Nobody can find it in the
+	 * table while we hold sfs_vnlock, and it isn't anywhere else.
+	 * If someone has, leave it loaded; it's been written out, and
+	 * if its link count is 0 it's already empty.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	svp = &sfs->sfs_vnhash[sv->sv_ino % SFS_VNHASHSIZE];
+	while (*svp != sv) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
 		}
+		svp = &(*svp)->sv_hashnext;
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	/*
+	 * If there are no on-disk references, discard the inode. Not
+	 * before it's out of the table, since the inode number can be
+	 * handed out again right away, and not after letting go of the
+	 * table: once sfs_nvnodes drops, unmount may tear down the fs.
+	 */
+	if (sv->sv_i.sfi_linkcount==0) {
+		sfs_bfree(sfs, sv->sv_ino);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
-	VOP_CLEANUP(&sv->sv_v);
+	sfs->sfs_nvnodes--;
+	lock_release(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	lock_destroy(sv->sv_lock);
+	VOP_CLEANUP(&sv->sv_v);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -971,9 +1472,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +1491,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +1534,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1045,7 +1548,8 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 }
 
 /*
- * Return the type of the file (types as per kern/stat.h)
+ * Return the type of the file (types as per kern/stat.h). The type
+ * never changes once the vnode is loaded, so this doesn't lock.
  */
 static
 int
@@ -1053,16 +1557,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1094,62 +1594,143 @@ sfs_tryseek(struct vnode *v, off_t pos)
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
  * and some other cases.
+ *
+ * The buffer cache doesn't know which blocks belong to which file, so
+ * this writes out everything dirty on the volume.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result == 0) {
+		result = buffer_sync_dev(sfs->sfs_device);
+	}
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM system does the paging through sfs_read
+ * and sfs_write, so any regular file can be mapped.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks of a file from file block BLOCKLEN on, out of the
+ * indirect block IDBLOCK, which has DEPTH levels of indirection under
+ * it and maps file blocks from BASEBLOCK up. Sets *EMPTY if nothing
+ * is left in IDBLOCK afterwards, in which case the caller should free
+ * IDBLOCK itself.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_indirect(struct sfs_fs *sfs, uint32_t idblock, int depth,
+		      uint32_t baseblock, uint32_t blocklen, bool *empty)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, span, start;
+	bool subempty;
+	int result;
+	int hasnonzero, iddirty;
 
-	struct sfs_vnode *sv = v->vn_data;
+	/* Number of file blocks under each entry */
+	span = 1;
+	for (j=1; j<(uint32_t)depth; j++) {
+		span *= SFS_DBPERIDB;
+	}
+
+	/* Read the indirect block */
+	result = buffer_read(sfs->sfs_device, idblock, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buffer_map(idbuf);
+
+	hasnonzero = 0;
+	iddirty = 0;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		start = baseblock + j*span;
+
+		/* Discard any blocks that are past the new EOF */
+		if (iddata[j] != 0 && blocklen < start + span) {
+			if (depth == 1) {
+				subempty = true;
+			}
+			else {
+				/* Part of what's under it goes; recurse */
+				result = sfs_truncate_indirect(sfs, iddata[j],
+						depth-1, start, blocklen,
+						&subempty);
+				if (result) {
+					if (iddirty) {
+						sfs_writebuf(idbuf);
+					}
+					else {
+						buffer_release(idbuf);
+					}
+					return result;
+				}
+			}
+			if (subempty) {
+				sfs_bfree(sfs, iddata[j]);
+				iddata[j] = 0;
+				iddirty = 1;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j]!=0) {
+			hasnonzero=1;
+		}
+	}
+
+	if (iddirty && hasnonzero) {
+		/* The indirect block is dirty */
+		sfs_writebuf(idbuf);
+	}
+	else {
+		/* Unchanged, or about to be freed */
+		buffer_release(idbuf);
+	}
+
+	*empty = !hasnonzero;
+	return 0;
+}
+
+/*
+ * Change the length of a file, freeing any blocks past the new end.
+ * Must hold sv_lock.
+ */
+static
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block;
+	uint32_t *idptr, baseblock, span;
+	int depth;
+	bool empty;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	/* Blocks are about to go away; forget the last run found. */
+	sv->sv_extlen = 0;
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +1745,34 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
+	/*
+	 * Then the single, double, and triple indirect blocks.
+	 * BASEBLOCK is the lowest block under each, and SPAN the
+	 * number of blocks under it.
+	 */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
+	span = SFS_DBPERIDB;
+	for (depth=1; depth<=SFS_NINDIRECT; depth++) {
+		idptr = sfs_inode_indirect(sv, depth);
+
+		if (blocklen < baseblock + span && *idptr != 0) {
+			/* We're past the proposed EOF; may need to free stuff */
+			result = sfs_truncate_indirect(sfs, *idptr, depth,
+						       baseblock, blocklen,
+						       &empty);
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
+			if (empty) {
+				/* The whole indirect block is empty now; free it */
+				sfs_bfree(sfs, *idptr);
+				*idptr = 0;
+				sv->sv_dirty = true;
+			}
 		}
+
+		baseblock += span;
+		span *= SFS_DBPERIDB;
 	}
 
 	/* Set the file size */
@@ -1220,10 +1781,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,37 +1836,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1299,20 +1875,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	*ret = &newguy->sv_v;
-	
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1331,20 +1909,27 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* No hard links to directories (this also keeps F != SV) */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EISDIR;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,28 +1945,41 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	/* Directories aren't removed this way (this also keeps VICTIM != SV) */
+	if (victim->sv_i.sfi_type == SFS_TYPE_DIR) {
+		lock_release(sv->sv_lock);
+		VOP_DECREF(&victim->sv_v);
+		return EISDIR;
+	}
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	lock_release(sv->sv_lock);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. If it was the
+	 * last, this erases the file, which needn't hold up the directory.
+	 */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,15 +1999,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,8 +2028,16 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	/* Linking may have rehashed the directory, so find n1 again. */
+	result = sfs_dir_findname(sv, n1, NULL, &slot1, NULL);
+	if (result) {
+		goto puke_harder;
+	}
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +2049,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +2073,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2097,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2109,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2126,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1644,40 +2247,38 @@ static const struct vnode_ops sfs_dirops = {
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. Takes sfs_vnlock, so that two threads
+ * can't both load the same inode; the caller may hold vnode locks.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
+	unsigned h;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	h = ino % SFS_VNHASHSIZE;
+	for (sv = sfs->sfs_vnhash[h]; sv != NULL; sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+
 			/* May only be set when creating new objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -1687,6 +2288,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,13 +2307,26 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No reads yet */
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawin = 0;
+
+	/* Nothing allocated or mapped yet */
+	sv->sv_allocnext = 0;
+	sv->sv_extfile = 0;
+	sv->sv_extdisk = 0;
+	sv->sv_extlen = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1736,7 +2357,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1744,12 +2367,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2389,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
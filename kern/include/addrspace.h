@@ -41,6 +41,27 @@
 struct vnode;
 
 
+/*
+ * A file mapped with mmap. Pages are read in from the file when first
+ * touched; for MAP_SHARED mappings, pages that have been written are
+ * written back by as_msync and when the mapping goes away.
+ */
+struct mmap_page {
+  vaddr_t mp_kvaddr;			/* kernel address of the page, or 0 */
+  bool mp_dirty;			/* written since last written back */
+};
+
+struct mmap_region {
+  vaddr_t mr_base;
+  size_t mr_npages;
+  struct vnode *mr_vnode;		/* referenced */
+  off_t mr_offset;			/* file offset of mr_base */
+  bool mr_writeable;			/* PROT_WRITE */
+  bool mr_shared;			/* MAP_SHARED */
+  struct mmap_page *mr_pages;
+  struct mmap_region *mr_next;
+};
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -57,6 +78,8 @@ struct addrspace {
   size_t as_npages2;
   struct pagetableEtry *as_stack;
   bool readonlyON;
+  struct mmap_region *as_mmaps;		/* mapped files */
+  vaddr_t as_mmaptop;			/* next mapping goes below this */
 };
 
 /*
@@ -93,6 +116,16 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_mmap   - map LEN bytes of a file, from page-aligned OFFSET, at
+ *                an address of the system's choosing. PROT and FLAGS
+ *                are as for mmap(). Hands back the address.
+ *
+ *    as_munmap - remove the mapping made at ADDR, writing back any
+ *                modified shared pages first.
+ *
+ *    as_msync  - write back modified shared pages mapping file VN (or
+ *                every file, if VN is NULL).
  */
 
 struct addrspace *as_create(void);
@@ -109,6 +142,11 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_mmap(struct addrspace *as, struct vnode *vn,
+                          off_t offset, size_t len, int prot, int flags,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int               as_msync(struct addrspace *as, struct vnode *vn);
 
 
 /*
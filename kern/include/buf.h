@@ -0,0 +1,94 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Caches device blocks in memory, keyed by device and block number,
+ * with least-recently-used replacement. All buffers are BUFFER_SIZE
+ * bytes, which must be the device's block size.
+ *
+ * The cache is write-back: a dirty buffer is written when it's evicted,
+ * when someone syncs it or its device, or by the flusher thread once it
+ * has been dirty for longer than the maximum age (see buffer_setmaxage).
+ *
+ * buffer_get and buffer_read hand back a buffer that is pinned ("busy"):
+ * it belongs to the caller until buffer_release, can't be evicted, and
+ * anyone else asking for the same block waits. So callers should hold
+ * buffers only briefly and not pin many at once.
+ *
+ * Functions:
+ *     buffer_bootstrap - Set up the cache. Called from vfs_bootstrap.
+ *     buffer_read      - Get a buffer for a block, reading it in if it
+ *                        isn't cached.
+ *     buffer_get       - Get a buffer for a block without reading it, for
+ *                        a caller about to overwrite the whole block. The
+ *                        contents are the block's if buffer_isvalid says
+ *                        so, and garbage otherwise.
+ *     buffer_map       - The buffer's data.
+ *     buffer_isvalid   - True if the data is the block's contents.
+ *     buffer_readahead - Ask for a block to be read into the cache in the
+ *                        background, if it isn't there already. This is
+ *                        only a hint; requests may be dropped.
+ *     buffer_mark_valid - Say the caller has filled in the data.
+ *     buffer_mark_dirty - Say the data has changed and needs writing out.
+ *                        Implies valid.
+ *     buffer_sync      - Write a pinned buffer out now if it's dirty.
+ *     buffer_release   - Unpin a buffer.
+ *     buffer_sync_dev  - Write out all dirty buffers for a device.
+ *     buffer_drop      - Forget a block without writing it, for a block
+ *                        being freed. It must not be pinned by the caller.
+ *     buffer_drop_dev  - Forget all buffers for a device, for unmount.
+ *                        The caller should sync the device first.
+ *     buffer_setmax    - Set the maximum number of buffers. Fails with
+ *                        EINVAL below BUFFER_MINMAX. When shrinking,
+ *                        dirty buffers are written and extra ones freed
+ *                        right away; any still pinned, or that failed to
+ *                        write, are freed as they are released or
+ *                        flushed, so the cache may stay over the limit
+ *                        for a while.
+ *     buffer_setmaxage - Set how many seconds a buffer may stay dirty
+ *                        before the flusher writes it.
+ *     buffer_setreadahead - Turn read-ahead on or off; returns the old
+ *                        setting.
+ *     buffer_purge     - Write out everything dirty and forget all
+ *                        buffers not in use, so that later reads go to
+ *                        disk. For measurements.
+ *     buffer_printstats - Print counts of hits, misses, and I/O.
+ */
+
+#define BUFFER_SIZE  512
+
+/*
+ * Fewest buffers allowed. Filesystems pin several at once (SFS holds
+ * one per level of indirection while allocating a block), and with
+ * everything pinned buffer_get waits forever.
+ */
+#define BUFFER_MINMAX  16
+
+struct buf;
+struct device;
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct device *dev, uint32_t block, struct buf **ret);
+int buffer_get(struct device *dev, uint32_t block, struct buf **ret);
+void buffer_readahead(struct device *dev, uint32_t block);
+void *buffer_map(struct buf *b);
+bool buffer_isvalid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+int buffer_sync(struct buf *b);
+void buffer_release(struct buf *b);
+
+int buffer_sync_dev(struct device *dev);
+void buffer_drop(struct device *dev, uint32_t block);
+void buffer_drop_dev(struct device *dev);
+
+int buffer_setmax(unsigned max);
+void buffer_setmaxage(unsigned secs);
+bool buffer_setreadahead(bool on);
+int buffer_purge(void);
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
@@ -0,0 +1,48 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Name lookup cache.
+ *
+ * Remembers what VOP_LOOKUP said for a (directory, name) pair: either
+ * the vnode found, or that there was no such name. The cache holds a
+ * reference to both vnodes of every entry, so a vnode never goes away
+ * (and its address is never reused) while an entry names it.
+ *
+ * Only single-component names on real filesystems are cached. Every
+ * operation that changes a directory must invalidate the names it
+ * touched, after the change is made; the vfs_* functions in vfspath.c
+ * take care of this.
+ *
+ * Functions:
+ *     dcache_bootstrap - Call during system startup.
+ *     dcache_lookup    - Look up NAME in DIR. Returns true on a hit, and
+ *                        hands back the vnode (with a reference added)
+ *                        or NULL for a name known not to exist. On a
+ *                        miss, hands back a generation number for a
+ *                        later dcache_enter.
+ *     dcache_enter     - Remember the result of a lookup that missed.
+ *                        VN is NULL for a name that does not exist. Does
+ *                        nothing if anything was invalidated since GEN
+ *                        was handed out, since the result may be stale.
+ *     dcache_invalidate - Forget NAME in DIR. If it named a directory,
+ *                        also forget all names in that directory.
+ *     dcache_purge_fs  - Forget everything on a filesystem, for unmount.
+ *     dcache_printstats - Print counts of hits and misses.
+ */
+
+struct vnode;
+struct fs;
+
+void dcache_bootstrap(void);
+
+bool dcache_lookup(struct vnode *dir, const char *name,
+		   struct vnode **ret, unsigned *gen);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		  unsigned gen);
+void dcache_invalidate(struct vnode *dir, const char *name);
+void dcache_purge_fs(struct fs *fs);
+void dcache_printstats(void);
+
+
+#endif /* _DCACHE_H_ */
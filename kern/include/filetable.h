@@ -0,0 +1,72 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+/*
+ * Open files and per-process file descriptor tables.
+ *
+ * An openfile is what open() creates: a vnode plus the seek position
+ * and access mode. Descriptors refer to openfiles, and after fork or
+ * dup2 several descriptors (in one process or several) can refer to
+ * the same one and so share its offset. Openfiles are refcounted and
+ * closed when the last descriptor goes away.
+ *
+ * A filetable maps descriptor numbers to openfiles. It belongs to one
+ * process, and since processes are single-threaded it is not locked.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_append;			/* O_APPEND */
+	struct lock *of_lock;		/* protects of_offset */
+	off_t of_offset;
+	struct spinlock of_reflock;	/* protects of_refcount */
+	unsigned of_refcount;
+};
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+/* Open PATH (which may be destroyed) and make an openfile for it. */
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+
+/* Add or drop a reference. Dropping the last one closes the file. */
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+/* Create and destroy tables. Destroying closes anything still open. */
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+
+/* Make a copy of a table for fork; the copy shares the openfiles. */
+int filetable_copy(struct filetable *src, struct filetable **ret);
+
+/* Open the console as stdin, stdout and stderr. */
+int filetable_openstd(struct filetable *ft);
+
+/*
+ * Look up descriptor FD. Fails with EBADF if it isn't open. The
+ * openfile returned is not separately referenced; it stays valid until
+ * the table is changed.
+ */
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+
+/* Put OF in the lowest free descriptor, taking over the caller's reference. */
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+
+/*
+ * Put OF at descriptor FD, taking over the caller's reference. Whatever
+ * was there before is handed back through OLDFILE (or NULL), still
+ * referenced, for the caller to drop.
+ */
+void filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		       struct openfile **oldfile);
+
+#endif /* _FILETABLE_H_ */
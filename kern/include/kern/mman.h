@@ -0,0 +1,22 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap() and munmap().
+ */
+
+/* Protection bits for mmap(). */
+#define PROT_NONE     0
+#define PROT_READ     1      /* Pages may be read */
+#define PROT_WRITE    2      /* Pages may be written */
+#define PROT_EXEC     4      /* Pages may be executed */
+
+/* Flags for mmap(); exactly one of MAP_SHARED and MAP_PRIVATE. */
+#define MAP_SHARED    1      /* Writes go back to the file */
+#define MAP_PRIVATE   2      /* Writes stay in this process */
+
+/* Error return from mmap(). */
+#define MAP_FAILED    ((void *)-1)
+
+
+#endif /* _KERN_MMAN_H_ */
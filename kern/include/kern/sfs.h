@@ -46,6 +46,7 @@
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
+#define SFS_DIRBUCKETS_MAX 128          /* max # of hashed dir buckets */
 
 /* Number of bits in a block */
 #define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
@@ -76,6 +77,12 @@ struct sfs_super {
 
 /*
  * On-disk inode
+ *
+ * The first SFS_NDIRECT blocks of the file are in sfi_direct, the next
+ * SFS_DBPERIDB under sfi_indirect, the next SFS_DBPERIDB^2 under
+ * sfi_dindirect, and the next SFS_DBPERIDB^3 under sfi_tindirect. The
+ * last two came later and live in what used to be sfi_waste, which is
+ * why they are not next to sfi_indirect.
  */
 struct sfs_inode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -83,11 +90,25 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dirbuckets;		/* Hashed dir buckets, or 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
 /*
  * On-disk directory entry
+ *
+ * A directory is an array of these; free slots have sfd_ino set to
+ * SFS_NOINO. If the directory's sfi_dirbuckets is 0 (as it is on
+ * volumes made before hashed directories), entries may be in any slot.
+ * Otherwise the directory is at least sfi_dirbuckets blocks long, a
+ * power of two, and each name is in block number
+ *	FNV-1a(name) % sfi_dirbuckets
+ * where FNV-1a is the 32-bit Fowler/Noll/Vo hash of the name's bytes
+ * without the terminating null, unless that block was full when the
+ * name was added; then it is in some slot past the last bucket. Those
+ * overflow slots have to be searched linearly.
  */
 struct sfs_dir {
 	uint32_t sfd_ino;			/* Inode number */
@@ -0,0 +1,48 @@
+#ifndef _KERN_SYSRING_H_
+#define _KERN_SYSRING_H_
+
+/*
+ * Batched system call ring, for sysring_enter().
+ *
+ * A program puts a struct sysring somewhere in its own memory (it fits
+ * in one page), queues operations in the submission queue, advances
+ * sr_sq_tail, and calls sysring_enter(). The kernel runs the queued
+ * operations in order, all in the one trap, posts a completion for each
+ * in the completion queue, and advances sr_sq_head and sr_cq_tail. The
+ * program consumes completions and advances sr_cq_head.
+ *
+ * Head and tail are free-running counters; the slot for counter value
+ * N is N % SYSRING_ENTRIES. A queue is empty when head == tail.
+ */
+
+#define SYSRING_ENTRIES  64
+
+/* Operations. The arguments are those of the ordinary system call. */
+#define SYSRING_OP_NOP      0	/* no arguments; result 0 */
+#define SYSRING_OP_WRITE    1	/* fd, buf, nbytes */
+#define SYSRING_OP_READ     2	/* fd, buf, nbytes */
+#define SYSRING_OP_GETPID   3	/* no arguments */
+#define SYSRING_OP_WAITPID  4	/* pid, status, options */
+
+struct sysring_sqe {
+	int32_t sqe_op;			/* SYSRING_OP_* */
+	int32_t sqe_args[3];
+	uint32_t sqe_user;		/* copied to the completion */
+};
+
+struct sysring_cqe {
+	uint32_t cqe_user;		/* from the submission */
+	int32_t cqe_result;		/* return value, if cqe_error is 0 */
+	int32_t cqe_error;		/* errno value, or 0 */
+};
+
+struct sysring {
+	uint32_t sr_sq_head;		/* advanced by the kernel */
+	uint32_t sr_sq_tail;		/* advanced by the program */
+	uint32_t sr_cq_head;		/* advanced by the program */
+	uint32_t sr_cq_tail;		/* advanced by the kernel */
+	struct sysring_sqe sr_sq[SYSRING_ENTRIES];
+	struct sysring_cqe sr_cq[SYSRING_ENTRIES];
+};
+
+#endif /* _KERN_SYSRING_H_ */
@@ -0,0 +1,69 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention profiling.
+ *
+ * When the kernel is configured with "options lockstat", every sleep
+ * lock, every wait channel, and every spinlock that has been given a
+ * name (see spinlock_setname) is charged to a lockstat class. Classes
+ * are keyed by kind and name, so for example all the locks created
+ * with the same name share one set of counters.
+ *
+ * For each class we keep the number of acquisitions, the number of
+ * those that had to wait, the total time spent waiting, and the
+ * longest time the lock was held. For wait channels an acquisition
+ * is a sleep, and both the wait and hold times are time spent asleep.
+ *
+ * Times come from gettime(), so nothing is recorded until
+ * lockstat_bootstrap is called after the clock has been attached.
+ * The "lockstat" menu command prints the classes sorted by total
+ * wait time.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+/* Kinds of lockstat class. */
+#define LOCKSTAT_LOCK      0	/* struct lock */
+#define LOCKSTAT_SPINLOCK  1	/* struct spinlock */
+#define LOCKSTAT_WCHAN     2	/* struct wchan */
+
+struct lockstat; /* Opaque */
+
+/* True while statistics are being gathered. */
+extern volatile bool lockstat_enabled;
+
+/* Call once during system startup, after the clock is available. */
+void lockstat_bootstrap(void);
+
+/*
+ * Find (or make) the class for KIND and NAME. The name is copied, and
+ * may be truncated. Never fails; if the table fills up, the result is
+ * a catch-all class.
+ */
+struct lockstat *lockstat_get(int kind, const char *name);
+
+/*
+ * Recording hooks for the lock implementations.
+ *
+ * lockstat_now returns a timestamp in nanoseconds, or 0 if statistics
+ * are off. Pass the time waiting started (or 0 if the acquisition did
+ * not have to wait) to lockstat_acquired; it returns the start of the
+ * hold time, to be handed back to lockstat_released.
+ */
+uint64_t lockstat_now(void);
+uint64_t lockstat_acquired(struct lockstat *ls, uint64_t waitstart);
+void lockstat_released(struct lockstat *ls, uint64_t holdstart);
+void lockstat_slept(struct lockstat *ls, uint64_t sleepstart);
+
+/* Zero all the counters. */
+void lockstat_reset(void);
+
+/* Print the classes, most waited-on first. */
+void lockstat_print(void);
+
+#endif /* OPT_LOCKSTAT */
+
+#endif /* _LOCKSTAT_H_ */
@@ -5,22 +5,36 @@
 #include <proc.h>
 #include <synch.h>
 
+/*
+ * One process table entry. The entry outlives its process until the
+ * exit status has been collected (or nobody is left to collect it).
+ *
+ * Each entry is on one of its parent's two lists: the running children,
+ * or the exited children waiting to be collected, oldest first. All the
+ * fields are protected by the proctable's own spinlock.
+ */
 struct proctable_node {
 	struct proc *proc;
-        pid_t parent;
-	bool exited;
+	pid_t pid;
+	pid_t parent;			/* -1 if nobody will wait for us */
+	bool exited;			/* only the status is left */
 	int exitcode;
-	struct cv *exitcv;
-	struct lock *exitlock;
+	struct proctable_node *children;	/* our running children */
+	struct proctable_node *exited_head;	/* our exited children */
+	struct proctable_node *exited_tail;
+	struct proctable_node *next_sibling;	/* links in one of the parent's lists */
+	struct proctable_node *prev_sibling;
 };
- 
-struct spinlock proctable_lock;
+
 extern struct proctable_node *proctable [PID_MAX-PID_MIN];
 
-int proctable_add(struct proc *p, pid_t *repid);
+void proctable_bootstrap(void);
+int proctable_add(struct proc *p, pid_t parent, pid_t *repid);
 struct proctable_node *proctable_get(pid_t pid);
-void proctable_update(pid_t pid);
+int proctable_wait(pid_t parent, pid_t pid, int options,
+		   pid_t *retpid, int *retstatus);
+void proctable_exit(pid_t pid, int exitcode);
+void proctable_reap(pid_t pid);
 void proctable_remove(pid_t pid);
 
 #endif /* _PROCARRAY_H_ */
-
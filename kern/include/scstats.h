@@ -0,0 +1,41 @@
+#ifndef _SCSTATS_H_
+#define _SCSTATS_H_
+
+/*
+ * System call statistics.
+ *
+ * When the kernel is configured with "options scstats", syscall()
+ * counts the calls to each system call number and the ones that
+ * failed, and keeps a log2 histogram of how long they took, timed with
+ * gettime(). Counters are kept per CPU, so recording takes no locks;
+ * they are summed when reported.
+ *
+ * The report is printed by the "scstats" menu command and can also be
+ * read from the "scstats:" device.
+ */
+
+#include "opt-scstats.h"
+
+#if OPT_SCSTATS
+
+/* Call once during system startup, after the clock and VFS are up. */
+void scstats_bootstrap(void);
+
+/*
+ * Hooks for syscall(). scstats_enter counts the call and returns a
+ * start time (0 if statistics are not being kept yet) to be handed to
+ * scstats_exit when the call returns. Calls that don't return, like
+ * _exit and a successful execv, are counted but not timed.
+ */
+uint64_t scstats_enter(int callno);
+void scstats_exit(int callno, uint64_t start, int err);
+
+/* Zero all the counters. */
+void scstats_reset(void);
+
+/* Print the report. */
+void scstats_print(void);
+
+#endif /* OPT_SCSTATS */
+
+#endif /* _SCSTATS_H_ */
@@ -48,11 +48,38 @@
  */
 #include <kern/sfs.h>
 
+/* Number of hash chains for finding loaded vnodes */
+#define SFS_VNHASHSIZE  64
+
+/*
+ * Locking. Each vnode's sv_lock protects its inode and the rest of
+ * its sfs_vnode, and for a directory, its contents. sfs_vnlock
+ * protects the table of loaded vnodes, and sfs_freemaplock the free
+ * block bitmap and the superblock. When more than one is needed they
+ * are taken in this order:
+ *
+ *     directory sv_lock
+ *     file sv_lock
+ *     sfs_vnlock
+ *     sfs_freemaplock
+ *
+ * The fields of struct vnode itself are the VFS layer's business.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	uint32_t sv_ranext;             /* where a sequential read would start */
+	uint32_t sv_raend;              /* read ahead up to this file block */
+	unsigned sv_rawin;              /* read-ahead window (blocks), 0 if none */
+	uint32_t sv_allocnext;          /* where to look for the next block */
+	uint32_t sv_extfile;            /* last run of blocks found by bmap: */
+	uint32_t sv_extdisk;            /*   first file block, its disk block, */
+	uint32_t sv_extlen;             /*   and length (0 if none) */
+	struct sfs_vnode *sv_hashnext;  /* chain in sfs_vnhash */
+	struct lock *sv_lock;           /* protects all of the above */
 };
 
 struct sfs_fs {
@@ -60,9 +87,13 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects the next two */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASHSIZE]; /* loaded vnodes, by ino */
+	unsigned sfs_nvnodes;           /* number of vnodes loaded */
+	struct lock *sfs_freemaplock;   /* protects the rest, and sfs_super */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t sfs_allochint;         /* just past the last block allocated */
 };
 
 /*
@@ -75,17 +106,20 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+struct buf;
 
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/* Convenience functions for block I/O through the buffer cache */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
-int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
+int sfs_wblock(struct sfs_fs *sfs, const void *data, uint32_t block);
+
+/* Release a buffer SFS has modified */
+void sfs_writebuf(struct buf *b);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Write a vnode's inode into the buffer cache. Must hold sv_lock. */
+int sfs_sync_inode(struct sfs_vnode *sv);
+
 
 #endif /* _SFS_H_ */
@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -57,12 +58,26 @@
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	const char *lk_name;		/* Profiling name, or NULL. */
+	struct lockstat *lk_stat;	/* Profiling class, once looked up. */
+	uint64_t lk_holdstart;		/* When the holder got the lock. */
+#endif
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or
+ * global. The named form gives the lock a name for lock profiling
+ * (see lockstat.h); NAME should be a string constant.
  */
+#if OPT_LOCKSTAT
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, NULL, NULL, 0 }
+#define SPINLOCK_NAMED_INITIALIZER(name) \
+	{ SPINLOCK_DATA_INITIALIZER, NULL, name, NULL, 0 }
+#else
 #define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_NAMED_INITIALIZER(name) SPINLOCK_INITIALIZER
+#endif
 
 /*
  * Spinlock functions.
@@ -74,10 +89,15 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Name the lock for lock profiling. Unnamed spinlocks are
+ *		not profiled. NAME should be a string constant. Does
+ *		nothing unless the kernel has "options lockstat".
  */
 
 void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
+void spinlock_setname(struct spinlock *lk, const char *name);
 
 void spinlock_acquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
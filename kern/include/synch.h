@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -78,6 +79,10 @@ struct lock {
         struct spinlock lk_lock;
         struct wchan *lk_wchan;
         struct  thread *lk_holder;
+#if OPT_LOCKSTAT
+        struct lockstat *lk_stat;       /* profiling class */
+        uint64_t lk_holdstart;          /* when the holder got the lock */
+#endif
         // add what you need here
         // (don't forget to mark things volatile as needed)
 };
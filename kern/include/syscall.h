@@ -50,6 +50,9 @@ void enter_forked_process(struct trapframe *tf);
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
+/* Set up the futex wait table. Call once during system startup. */
+void futex_bootstrap(void);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -57,11 +60,29 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_futex_wait(userptr_t uaddr, int val);
+int sys_futex_wake(userptr_t uaddr, int count, int *retval);
 
 #ifdef UW
+int sys_sysring_enter(userptr_t uring, unsigned max, int *retval);
 int sys_fork(pid_t *retval, struct trapframe *tf);
+int sys_spawn(userptr_t path, userptr_t argv, pid_t *retval);
 int sys_execv(userptr_t program, userptr_t args);
+int sys_open(userptr_t upath, int flags, mode_t mode, int *retval);
+int sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_pread(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval);
+int sys_pwrite(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval);
+int sys_readv(int fdesc,const_userptr_t uiov,int iovcnt,int *retval);
+int sys_writev(int fdesc,const_userptr_t uiov,int iovcnt,int *retval);
+int sys_sendfile(int outfd, int infd, userptr_t uoffset, size_t count, int *retval);
+int sys_close(int fdesc);
+int sys_fsync(int fdesc);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fdesc,
+	     off_t pos, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
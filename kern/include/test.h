@@ -74,12 +74,15 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int readspeed(int, char **);
+int dirnames(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
 int nettest(int, char **);
+int copybench(int, char **);
 
 /* Routine for running a user-level program. */
 #if OPT_A2 
@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,10 +51,14 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_countlock protects both counts. Anything else about the file
+ * is up to the filesystem to lock.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for the counts */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
@@ -135,9 +140,11 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file may be mapped into
+ *                      memory. The VM system pages mapped files in and
+ *                      out itself with vop_read and vop_write, so
+ *                      this only has to say yes or no; files that
+ *                      can't be mapped fail with EUNIMP.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -47,9 +47,21 @@
 #define WORD_TYPE       unsigned char
 #define WORD_ALLBITS    (0xff)
 
+/*
+ * Alongside the bits we keep a summary with one bit per word of the
+ * map, set when that word is full, so that searching for a clear bit
+ * can step over 32 full words at a time. It lives only in memory.
+ * Since bitmap_getdata lets the caller change the bits behind our
+ * back, handing out the data marks the summary stale, and it is
+ * rebuilt the next time we search. bitmap_getdata_const doesn't.
+ */
+#define SUMMARY_BITS    32
+
 struct bitmap {
         unsigned nbits;
         WORD_TYPE *v;
+        uint32_t *full;         /* summary: word is full */
+        bool fullvalid;         /* summary is up to date */
 };
 
 
@@ -57,9 +69,10 @@ struct bitmap *
 bitmap_create(unsigned nbits)
 {
         struct bitmap *b; 
-        unsigned words;
+        unsigned words, sumwords;
 
         words = DIVROUNDUP(nbits, BITS_PER_WORD);
+        sumwords = DIVROUNDUP(words, SUMMARY_BITS);
         b = kmalloc(sizeof(struct bitmap));
         if (b == NULL) {
                 return NULL;
@@ -69,9 +82,16 @@ bitmap_create(unsigned nbits)
                 kfree(b);
                 return NULL;
         }
+        b->full = kmalloc(sumwords*sizeof(uint32_t));
+        if (b->full == NULL) {
+                kfree(b->v);
+                kfree(b);
+                return NULL;
+        }
 
         bzero(b->v, words*sizeof(WORD_TYPE));
         b->nbits = nbits;
+        b->fullvalid = false;
 
         /* Mark any leftover bits at the end in use */
         if (words > nbits / BITS_PER_WORD) {
@@ -92,30 +112,156 @@ bitmap_create(unsigned nbits)
 void *
 bitmap_getdata(struct bitmap *b)
 {
+        b->fullvalid = false;
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+const void *
+bitmap_getdata_const(struct bitmap *b)
+{
+        return b->v;
+}
+
+/*
+ * Rebuild the summary from the bits. Summary bits past the last word
+ * are set, so they look full.
+ */
+static
+void
+bitmap_summarize(struct bitmap *b)
 {
+        unsigned words = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned sumwords = DIVROUNDUP(words, SUMMARY_BITS);
         unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+
+        for (ix=0; ix<sumwords; ix++) {
+                b->full[ix] = 0;
+        }
+        for (ix=0; ix<sumwords*SUMMARY_BITS; ix++) {
+                if (ix >= words || b->v[ix]==WORD_ALLBITS) {
+                        b->full[ix/SUMMARY_BITS] |=
+                                (uint32_t)1 << (ix%SUMMARY_BITS);
+                }
+        }
+        b->fullvalid = true;
+}
+
+/*
+ * Index of the lowest clear bit in X, which must not be all ones.
+ * A binary search, rather than a bit at a time.
+ */
+static
+unsigned
+bitmap_firstclear(uint32_t x)
+{
+        unsigned n = 0;
+
+        KASSERT(x != 0xffffffff);
+        x = ~x;
+        if ((x & 0xffff) == 0) {
+                n += 16;
+                x >>= 16;
+        }
+        if ((x & 0xff) == 0) {
+                n += 8;
+                x >>= 8;
+        }
+        if ((x & 0xf) == 0) {
+                n += 4;
+                x >>= 4;
+        }
+        if ((x & 0x3) == 0) {
+                n += 2;
+                x >>= 2;
+        }
+        if ((x & 0x1) == 0) {
+                n += 1;
+        }
+        return n;
+}
+
+/*
+ * Set the lowest clear bit in word IX that isn't in SKIP, and return
+ * its index. There must be one.
+ */
+static
+unsigned
+bitmap_take(struct bitmap *b, unsigned ix, WORD_TYPE skip)
+{
         unsigned offset;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
-
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
-                                }
-                        }
-                        KASSERT(0);
+        offset = bitmap_firstclear(b->v[ix] | skip |
+                                   ~(uint32_t)WORD_ALLBITS);
+        b->v[ix] |= ((WORD_TYPE)1) << offset;
+        if (b->v[ix]==WORD_ALLBITS) {
+                b->full[ix/SUMMARY_BITS] |= (uint32_t)1 << (ix%SUMMARY_BITS);
+        }
+        KASSERT(ix*BITS_PER_WORD + offset < b->nbits);
+        return ix*BITS_PER_WORD + offset;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        return bitmap_alloc_near(b, 0, index);
+}
+
+/*
+ * Like bitmap_alloc, but take the first cleared bit at or after GOAL,
+ * wrapping around to the start if there is none, so that consecutive
+ * allocations with consecutive goals come out next to each other.
+ *
+ * After the goal's own word, this walks the summary, so the cost is
+ * proportional to the number of bits divided by BITS_PER_WORD *
+ * SUMMARY_BITS rather than to the number of bits.
+ */
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned words = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned sumwords = DIVROUNDUP(words, SUMMARY_BITS);
+        unsigned ix, sx, i;
+        WORD_TYPE lowbits;
+        uint32_t sum;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        if (!b->fullvalid) {
+                bitmap_summarize(b);
+        }
+
+        /* First the rest of the goal's own word. */
+        ix = goal / BITS_PER_WORD;
+        lowbits = (((WORD_TYPE)1) << (goal % BITS_PER_WORD)) - 1;
+        if ((b->v[ix] | lowbits) != WORD_ALLBITS) {
+                *index = bitmap_take(b, ix, lowbits);
+                return 0;
+        }
+
+        /*
+         * Then the words after it, a summary word at a time. Going
+         * once around and back to the summary word we started in
+         * brings us back to the goal's word and the bits below the
+         * goal.
+         */
+        ix++;
+        sx = ix / SUMMARY_BITS;
+        sum = (sx < sumwords) ?
+                b->full[sx] | (((uint32_t)1 << (ix%SUMMARY_BITS)) - 1) :
+                0xffffffff;
+        for (i=0; i<=sumwords; i++) {
+                if (sum != 0xffffffff) {
+                        ix = sx*SUMMARY_BITS + bitmap_firstclear(sum);
+                        KASSERT(ix < words);
+                        *index = bitmap_take(b, ix, 0);
+                        return 0;
+                }
+                sx++;
+                if (sx >= sumwords) {
+                        sx = 0;
                 }
+                sum = b->full[sx];
         }
         return ENOSPC;
 }
@@ -142,6 +288,9 @@ bitmap_mark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)==0);
         b->v[ix] |= mask;
+        if (b->v[ix]==WORD_ALLBITS) {
+                b->full[ix/SUMMARY_BITS] |= (uint32_t)1 << (ix%SUMMARY_BITS);
+        }
 }
 
 void
@@ -155,6 +304,7 @@ bitmap_unmark(struct bitmap *b, unsigned index)
 
         KASSERT((b->v[ix] & mask)!=0);
         b->v[ix] &= ~mask;
+        b->full[ix/SUMMARY_BITS] &= ~((uint32_t)1 << (ix%SUMMARY_BITS));
 }
 
 
@@ -171,6 +321,7 @@ bitmap_isset(struct bitmap *b, unsigned index)
 void
 bitmap_destroy(struct bitmap *b)
 {
+        kfree(b->full);
         kfree(b->v);
         kfree(b);
 }
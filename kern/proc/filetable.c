@@ -0,0 +1,183 @@
+/*
+ * Open files and per-process file descriptor tables.
+ * The interface is described in filetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <filetable.h>
+
+////////////////////////////////////////////////////////////
+// openfile
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct openfile *of;
+	int result;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	result = vfs_open(path, flags, mode, &of->of_vnode);
+	if (result) {
+		lock_destroy(of->of_lock);
+		kfree(of);
+		return result;
+	}
+
+	of->of_accmode = flags & O_ACCMODE;
+	of->of_append = (flags & O_APPEND) != 0;
+	of->of_offset = 0;
+	spinlock_init(&of->of_reflock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = (of->of_refcount == 0);
+	spinlock_release(&of->of_reflock);
+
+	if (last) {
+		vfs_close(of->of_vnode);
+		spinlock_cleanup(&of->of_reflock);
+		lock_destroy(of->of_lock);
+		kfree(of);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// filetable
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	int fd;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		ft->ft_files[fd] = NULL;
+	}
+	return ft;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	int fd;
+
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		if (ft->ft_files[fd] != NULL) {
+			openfile_decref(ft->ft_files[fd]);
+			ft->ft_files[fd] = NULL;
+		}
+	}
+	kfree(ft);
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	int fd;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		if (src->ft_files[fd] != NULL) {
+			openfile_incref(src->ft_files[fd]);
+			ft->ft_files[fd] = src->ft_files[fd];
+		}
+	}
+	*ret = ft;
+	return 0;
+}
+
+int
+filetable_openstd(struct filetable *ft)
+{
+	static const int stdflags[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of;
+	char path[5];
+	int fd, result;
+
+	for (fd = 0; fd < 3; fd++) {
+		KASSERT(ft->ft_files[fd] == NULL);
+		/* vfs_open may destroy the path, so use a fresh copy */
+		strcpy(path, "con:");
+		result = openfile_open(path, stdflags[fd], 0, &of);
+		if (result) {
+			return result;
+		}
+		ft->ft_files[fd] = of;
+	}
+	return 0;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *of, int *ret)
+{
+	int fd;
+
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		if (ft->ft_files[fd] == NULL) {
+			ft->ft_files[fd] = of;
+			*ret = fd;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
+
+void
+filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		  struct openfile **oldfile)
+{
+	KASSERT(fd >= 0 && fd < OPEN_MAX);
+	*oldfile = ft->ft_files[fd];
+	ft->ft_files[fd] = of;
+}
@@ -43,12 +43,15 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <proctable.h>
+#include <filetable.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -104,7 +107,7 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 
 #ifdef UW
-	proc->console = NULL;
+	proc->p_filetable = NULL;
 #endif // UW
 
 	return proc;
@@ -162,8 +165,8 @@ proc_destroy(struct proc *proc)
 #endif // UW
 
 #ifdef UW
-	if (proc->console) {
-	  vfs_close(proc->console);
+	if (proc->p_filetable) {
+	  filetable_destroy(proc->p_filetable);
 	}
 #endif // UW
 
@@ -212,6 +215,9 @@ proc_bootstrap(void)
     panic("could not create no_proc_sem semaphore\n");
   }
 #endif // UW 
+#if OPT_A2
+  proctable_bootstrap();
+#endif
 }
 
 /*
@@ -224,25 +230,15 @@ struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
-	char *console_path;
+#ifdef UW
+	int result;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
 
-#ifdef UW
-	/* open the console - this should always succeed */
-	console_path = kstrdup("con:");
-	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
-	}
-	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
-	}
-	kfree(console_path);
-#endif // UW
-	  
 	/* VM fields */
 
 	proc->p_addrspace = NULL;
@@ -275,6 +271,23 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+#ifdef UW
+	/* inherit the creator's open files (fork, spawn); a process
+	   started from the menu gets stdin, stdout and stderr on the console */
+	if (curproc->p_filetable != NULL) {
+	  result = filetable_copy(curproc->p_filetable, &proc->p_filetable);
+	}
+	else {
+	  proc->p_filetable = filetable_create();
+	  result = (proc->p_filetable == NULL) ? ENOMEM :
+	    filetable_openstd(proc->p_filetable);
+	}
+	if (result) {
+	  proc_destroy(proc);
+	  return NULL;
+	}
+#endif // UW
+
 	return proc;
 }
 
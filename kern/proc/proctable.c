@@ -1,51 +1,197 @@
 #include <types.h>
+#include <lib.h>
 #include <proc.h>
 #include <synch.h>
+#include <wchan.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <kern/errno.h>
 #include <proctable.h>
 
+#define PROCTABLE_SIZE (PID_MAX-PID_MIN)
+#define PIDMAP_WORDS ((PROCTABLE_SIZE + 31) / 32)
+
 // Global process table
 struct proctable_node *proctable [PID_MAX-PID_MIN];
 
+// Protects proctable[], the pid map, and the parent/child links
+static struct spinlock proctable_lock;
+
+// One bit per pid slot, set while the pid is in use
+static uint32_t pidmap[PIDMAP_WORDS];
+
+// Slot where the next pid search starts
+static unsigned pidhint;
+
+/*
+ * Pool of wait channels for waitpid, shared by all entries and picked by
+ * the waiting parent's pid. Used with proctable_lock as the interlock.
+ * Most children are waited for at most once, so giving each entry its
+ * own made every fork pay for allocations that were rarely used.
+ */
+#define EXITCHAN_COUNT 16
+
+static struct wchan *exitchans[EXITCHAN_COUNT];
+
 // Private function prototypes
 struct proctable_node *proctable_create_node(struct proc *p);
-int proctable_setsize(unsigned num);
+static void proctable_destroy_node(struct proctable_node *pt);
 
 
 /**
- * Adds a process to the process table. Returns its new pid through the second
- * parameter. Returns an error code.
+ * Sets up the process table. Call once during system startup.
  */
-int
-proctable_add(struct proc *p, pid_t *repid)
+void
+proctable_bootstrap(void)
 {
 	unsigned i;
-	struct proctable_node *pt;
 
-	spinlock_acquire(&proctable_lock);
+	spinlock_init(&proctable_lock);
+	pidhint = 0;
+
+	for (i = 0; i < EXITCHAN_COUNT; i++) {
+		exitchans[i] = wchan_create("proctable exit");
+		if (exitchans[i] == NULL) {
+			panic("proctable_bootstrap: wchan_create failed\n");
+		}
+	}
+
+	// Mark the padding bits past the end of the table as taken
+	for (i = PROCTABLE_SIZE; i < PIDMAP_WORDS*32; i++) {
+		pidmap[i/32] |= (uint32_t)1 << (i%32);
+	}
+}
+
+/**
+ * Claims a free pid slot. The search starts where the last one left off, so
+ * pids are handed out round-robin and not reused right away, and skips full
+ * words of the map 32 slots at a time. Must hold proctable_lock.
+ */
+static
+int
+pidmap_alloc(unsigned *slot)
+{
+	unsigned i, w, bit;
+	uint32_t word;
+
+	w = pidhint / 32;
+	// One extra step to come back around to the bits below the hint
+	for (i = 0; i <= PIDMAP_WORDS; i++, w = (w+1) % PIDMAP_WORDS) {
+		word = pidmap[w];
+		if (i == 0) {
+			word |= ((uint32_t)1 << (pidhint % 32)) - 1;
+		}
+		if (word == 0xffffffff) {
+			continue;
+		}
+		for (bit = 0; word & ((uint32_t)1 << bit); bit++) {
+			// find first zero bit
+		}
+		pidmap[w] |= (uint32_t)1 << bit;
+		*slot = w*32 + bit;
+		KASSERT(*slot < PROCTABLE_SIZE);
+		pidhint = (*slot + 1) % PROCTABLE_SIZE;
+		return 0;
+	}
+	return ENPROC;
+}
+
+/**
+ * Takes an entry out of the table and frees its pid. Must hold
+ * proctable_lock.
+ */
+static
+void
+proctable_unpublish(struct proctable_node *pt)
+{
+	unsigned slot = pt->pid - PID_MIN;
+
+	KASSERT(proctable[slot] == pt);
+	proctable[slot] = NULL;
+	pidmap[slot/32] &= ~((uint32_t)1 << (slot%32));
+}
+
+/**
+ * Unlinks an entry from whichever of its parent's lists it is on: the
+ * running children, or the exited children. Must hold proctable_lock.
+ */
+static
+void
+proctable_unlink(struct proctable_node *pt)
+{
+	struct proctable_node *parent;
+
+	if (pt->parent == -1) {
+		return;
+	}
+	parent = proctable[pt->parent-PID_MIN];
+	KASSERT(parent != NULL);
+
+	if (pt->prev_sibling != NULL) {
+		pt->prev_sibling->next_sibling = pt->next_sibling;
+	}
+	else if (pt->exited) {
+		parent->exited_head = pt->next_sibling;
+	}
+	else {
+		parent->children = pt->next_sibling;
+	}
+	if (pt->next_sibling != NULL) {
+		pt->next_sibling->prev_sibling = pt->prev_sibling;
+	}
+	else if (pt->exited) {
+		parent->exited_tail = pt->prev_sibling;
+	}
+	pt->next_sibling = pt->prev_sibling = NULL;
+	pt->parent = -1;
+}
+
+/**
+ * Adds a process to the process table as a child of PARENT (or -1 for
+ * none). Returns its new pid through the third parameter. Returns an error
+ * code.
+ */
+int
+proctable_add(struct proc *p, pid_t parent, pid_t *repid)
+{
+	struct proctable_node *pt, *pp;
+	unsigned slot;
+	int result;
 
 	// Create entry
 	pt = proctable_create_node(p);
 	if (pt == NULL) {
-		spinlock_release(&proctable_lock);
 		return ENOMEM;
 	}
 
+	spinlock_acquire(&proctable_lock);
+
 	// Find a spot in the table
-	for (i = 0; i < PID_MAX-PID_MIN; i++) {
-		if (proctable[i] == NULL) {
-            proctable[i] = (struct proctable_node *)pt;
-			*repid = i+PID_MIN;
-			spinlock_release(&proctable_lock);
-			return 0;
+	result = pidmap_alloc(&slot);
+	if (result) {
+		spinlock_release(&proctable_lock);
+		proctable_destroy_node(pt);
+		return result;
+	}
+	pt->pid = slot+PID_MIN;
+	proctable[slot] = pt;
+
+	// Link into the parent's children
+	if (parent != -1) {
+		pp = proctable[parent-PID_MIN];
+		KASSERT(pp != NULL);
+		pt->parent = parent;
+		pt->next_sibling = pp->children;
+		if (pp->children != NULL) {
+			pp->children->prev_sibling = pt;
 		}
+		pp->children = pt;
 	}
-    
-    spinlock_release(&proctable_lock);
-	return ENPROC;
 
-	panic("No vacant spot found in the process table");
+	spinlock_release(&proctable_lock);
+
+	*repid = pt->pid;
+	return 0;
 }
 
 /**
@@ -61,71 +207,224 @@ struct proctable_node *proctable_create_node(struct proc *p) {
 
 	// Set values
 	pt->proc = p;
-    pt->parent = -1;
+	pt->pid = -1;
+	pt->parent = -1;
 	pt->exitcode = -1;
 	pt->exited = false;
-	
-	// Create condition variable
-	pt->exitcv = cv_create(pt->proc->p_name);
-	if (pt->exitcv == NULL) {
-		kfree(pt);
-		return NULL;
-	}
+	pt->children = NULL;
+	pt->exited_head = NULL;
+	pt->exited_tail = NULL;
+	pt->next_sibling = NULL;
+	pt->prev_sibling = NULL;
 
-	// Create lock
-	pt->exitlock = lock_create(pt->proc->p_name);
-	if (pt->exitlock == NULL) {
-		cv_destroy(pt->exitcv);
-		kfree(pt);
-		return NULL;
-	}
 	return pt;
 }
 
+/**
+ * Frees a proctable entry that is no longer in the table.
+ */
+static
+void
+proctable_destroy_node(struct proctable_node *pt)
+{
+	KASSERT(pt->children == NULL);
+	KASSERT(pt->exited_head == NULL);
+	kfree(pt);
+}
+
 /**
  * Gets the proctable_entry with the specified pid. Returns NULL if no such
  * entry was found.
  */
 struct proctable_node * proctable_get(pid_t pid) {
-	if (pid > PID_MAX || pid < PID_MIN) {
+	if (pid >= PID_MAX || pid < PID_MIN) {
 		return NULL;
 	}
 	return proctable[pid-PID_MIN];
 }
 
 /**
- * updates a process's children in process table after it exits so we can reuse 
- * the pid
+ * Finds an exited child of PARENT to collect: PID itself, or with PID
+ * WAIT_ANY, whichever child exited first. Unless OPTIONS has WNOHANG,
+ * sleeps until there is one. On success hands back the child's pid and
+ * exit status; the entry stays in the table until proctable_reap. With
+ * WNOHANG and nothing to collect yet, hands back pid 0. Returns ESRCH if
+ * there is no such process and ECHILD if it is not PARENT's child, or if
+ * PARENT has no children at all.
  */
-void proctable_update(pid_t pid) {
-    for (int i=0; i<PID_MAX-PID_MIN; i++) {
-        if (proctable[i] && proctable[i]->parent == pid) {
-          if (proctable[i]->exited)
-                proctable_remove(i+PID_MIN);
-          else 
-                proctable[i]->parent = -1;
-          
-          }
-    }
+int
+proctable_wait(pid_t parent, pid_t pid, int options,
+	       pid_t *retpid, int *retstatus)
+{
+	struct proctable_node *pp, *pt;
+	struct wchan *wc;
+
+	if (pid != WAIT_ANY && (pid >= PID_MAX || pid < PID_MIN)) {
+		return ESRCH;
+	}
+	wc = exitchans[parent % EXITCHAN_COUNT];
+
+	spinlock_acquire(&proctable_lock);
+	pp = proctable[parent-PID_MIN];
+	KASSERT(pp != NULL);
+
+	while (1) {
+		if (pid == WAIT_ANY) {
+			if (pp->children == NULL && pp->exited_head == NULL) {
+				spinlock_release(&proctable_lock);
+				return ECHILD;
+			}
+			pt = pp->exited_head;
+		}
+		else {
+			pt = proctable[pid-PID_MIN];
+			if (pt == NULL) {
+				spinlock_release(&proctable_lock);
+				return ESRCH;
+			}
+			if (pt->parent != parent) {
+				spinlock_release(&proctable_lock);
+				return ECHILD;
+			}
+			if (!pt->exited) {
+				pt = NULL;
+			}
+		}
+		if (pt != NULL) {
+			break;
+		}
+		if (options & WNOHANG) {
+			spinlock_release(&proctable_lock);
+			*retpid = 0;
+			return 0;
+		}
+
+		/*
+		 * Bridge to the wchan lock so a child exiting right now
+		 * can't wake us before we are asleep. The wchan is shared
+		 * with other parents, so always recheck.
+		 */
+		wchan_lock(wc);
+		spinlock_release(&proctable_lock);
+		wchan_sleep(wc);
+		spinlock_acquire(&proctable_lock);
+	}
+
+	*retpid = pt->pid;
+	*retstatus = pt->exitcode;
+	spinlock_release(&proctable_lock);
+	return 0;
 }
 
 /**
- * Removes a process from the process table. 
+ * Called by an exiting process to publish its exit status. Children that
+ * have already exited are freed and the rest are orphaned. Then the entry
+ * is freed if nobody is left to wait for it, or else moved onto the
+ * parent's queue of exited children and the parent woken. Costs
+ * O(children).
  */
-void proctable_remove(pid_t pid) {	
-	struct proctable_node *pt = proctable[pid-PID_MIN];
+void
+proctable_exit(pid_t pid, int exitcode)
+{
+	struct proctable_node *pt, *pp, *child, *next, *dead;
+
+	dead = NULL;
+
+	spinlock_acquire(&proctable_lock);
+	pt = proctable[pid-PID_MIN];
 	KASSERT(pt != NULL);
-	
-    if (!lock_do_i_hold(pt->exitlock))
-		lock_acquire(pt->exitlock);
-        
-    lock_release(pt->exitlock);
-	lock_destroy(pt->exitlock);
-	cv_destroy(pt->exitcv);
-	kfree(pt);
 
-	// Reclaim pid
-	proctable[pid-PID_MIN] = NULL;
+	for (child = pt->children; child != NULL; child = next) {
+		next = child->next_sibling;
+		child->parent = -1;
+		child->next_sibling = child->prev_sibling = NULL;
+	}
+	pt->children = NULL;
+
+	// Nobody will collect these now
+	for (child = pt->exited_head; child != NULL; child = next) {
+		next = child->next_sibling;
+		child->parent = -1;
+		proctable_unpublish(child);
+		child->prev_sibling = NULL;
+		child->next_sibling = dead;
+		dead = child;
+	}
+	pt->exited_head = pt->exited_tail = NULL;
+
+	if (pt->parent == -1) {
+		pt->exited = true;
+		pt->exitcode = exitcode;
+		proctable_unpublish(pt);
+		pt->next_sibling = dead;
+		dead = pt;
+	}
+	else {
+		pp = proctable[pt->parent-PID_MIN];
+		KASSERT(pp != NULL);
+
+		// Move from the parent's running children to its exited ones
+		proctable_unlink(pt);
+		pt->parent = pp->pid;
+		pt->exited = true;
+		pt->exitcode = exitcode;
+		pt->prev_sibling = pp->exited_tail;
+		if (pp->exited_tail != NULL) {
+			pp->exited_tail->next_sibling = pt;
+		}
+		else {
+			pp->exited_head = pt;
+		}
+		pp->exited_tail = pt;
+
+		wchan_wakeall(exitchans[pp->pid % EXITCHAN_COUNT]);
+	}
+	spinlock_release(&proctable_lock);
+
+	// Free outside the spinlock
+	while (dead != NULL) {
+		next = dead->next_sibling;
+		dead->next_sibling = NULL;
+		proctable_destroy_node(dead);
+		dead = next;
+	}
+}
+
+/**
+ * Called by a parent that has collected a child's exit status through
+ * proctable_wait. Frees the child's entry and its pid.
+ */
+void
+proctable_reap(pid_t pid)
+{
+	struct proctable_node *pt;
+
+	spinlock_acquire(&proctable_lock);
+	pt = proctable[pid-PID_MIN];
+	KASSERT(pt != NULL);
+	KASSERT(pt->exited);
+	proctable_unlink(pt);
+	proctable_unpublish(pt);
+	spinlock_release(&proctable_lock);
+
+	proctable_destroy_node(pt);
 }
 
+/**
+ * Removes a process from the process table. Only for processes that never
+ * got to run, such as when fork fails part way.
+ */
+void proctable_remove(pid_t pid) {
+	struct proctable_node *pt;
 
+	spinlock_acquire(&proctable_lock);
+	pt = proctable[pid-PID_MIN];
+	KASSERT(pt != NULL);
+	KASSERT(pt->children == NULL);
+	KASSERT(!pt->exited);
+	proctable_unlink(pt);
+	proctable_unpublish(pt);
+	spinlock_release(&proctable_lock);
+
+	proctable_destroy_node(pt);
+}
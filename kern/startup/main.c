@@ -49,6 +49,8 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <lockstat.h>
+#include <scstats.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -121,9 +123,19 @@ boot(void)
 	pseudoconfig();
 	kprintf("\n");
 
+#if OPT_LOCKSTAT
+	/* The clock is attached now, so lock profiling can start. */
+	lockstat_bootstrap();
+#endif
+#if OPT_SCSTATS
+	/* Likewise system call timing; this also adds the scstats: device. */
+	scstats_bootstrap();
+#endif
+
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
+	futex_bootstrap();
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -42,12 +42,18 @@
 #include <current.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <buf.h>
+#include <dcache.h>
 #include <syscall.h>
 #include <test.h>
+#include <lockstat.h>
+#include <scstats.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-lockstat.h"
+#include "opt-scstats.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -148,9 +154,12 @@ common_prog(int nargs, char **args)
         }
         
         #if OPT_A2
-        spinlock_init(&proctable_lock);
         pid_t pid;
-        proctable_add(proc, &pid);
+        result = proctable_add(proc, -1, &pid);
+        if (result) {
+                proc_destroy(proc);
+                return result;
+        }
         spinlock_acquire(&proc->p_lock);
         proc->p_pid = pid;
         spinlock_release(&proc->p_lock);
@@ -420,6 +429,106 @@ cmd_kheapstats(int nargs, char **args)
         return 0;
 }
 
+/*
+ * Command for buffer cache statistics, or for setting its size, how
+ * long buffers may stay dirty, or whether to read ahead.
+ */
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+        if (nargs == 1) {
+                buffer_printstats();
+                return 0;
+        }
+        if (nargs == 3 && !strcmp(args[1], "size")) {
+                if (atoi(args[2]) < BUFFER_MINMAX) {
+                        kprintf("bc: size must be at least %d\n",
+                                BUFFER_MINMAX);
+                        return EINVAL;
+                }
+                return buffer_setmax(atoi(args[2]));
+        }
+        if (nargs == 3 && !strcmp(args[1], "age") && atoi(args[2]) >= 0) {
+                buffer_setmaxage(atoi(args[2]));
+                return 0;
+        }
+        if (nargs == 3 && !strcmp(args[1], "ra")) {
+                buffer_setreadahead(!strcmp(args[2], "on"));
+                return 0;
+        }
+
+        kprintf("Usage: bc [size nbuffers | age seconds | ra on|off]\n");
+        return EINVAL;
+}
+
+/*
+ * Command for name cache statistics.
+ */
+static
+int
+cmd_dcstats(int nargs, char **args)
+{
+        (void)nargs;
+        (void)args;
+
+        dcache_printstats();
+
+        return 0;
+}
+
+#if OPT_LOCKSTAT
+/*
+ * Command for lock contention statistics.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+        if (nargs == 1) {
+                lockstat_print();
+                return 0;
+        }
+        if (nargs == 2 && !strcmp(args[1], "reset")) {
+                lockstat_reset();
+                return 0;
+        }
+        if (nargs == 2 && !strcmp(args[1], "on")) {
+                lockstat_enabled = true;
+                return 0;
+        }
+        if (nargs == 2 && !strcmp(args[1], "off")) {
+                lockstat_enabled = false;
+                return 0;
+        }
+
+        kprintf("Usage: lockstat [reset|on|off]\n");
+        return EINVAL;
+}
+#endif
+
+#if OPT_SCSTATS
+/*
+ * Command for printing (or resetting) system call statistics.
+ */
+static
+int
+cmd_scstats(int nargs, char **args)
+{
+        if (nargs == 1) {
+                scstats_print();
+                return 0;
+        }
+        if (nargs == 2 && !strcmp(args[1], "reset")) {
+                scstats_reset();
+                return 0;
+        }
+
+        kprintf("Usage: scstats [reset]\n");
+        return EINVAL;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -481,6 +590,7 @@ static const char *testmenu[] = {
         "[bt]  Bitmap test                   ",
         "[km1] Kernel malloc test            ",
         "[km2] kmalloc stress test           ",
+        "[cb]  copyin/copyout benchmark      ",
         "[tt1] Thread test 1                 ",
         "[tt2] Thread test 2                 ",
         "[tt3] Thread test 3                 ",
@@ -499,6 +609,8 @@ static const char *testmenu[] = {
         "[fs3] FS write stress       (4)     ",
         "[fs4] FS write stress 2     (4)     ",
         "[fs5] FS create stress      (4)     ",
+        "[fs6] FS read speed                 ",
+        "[fs7] FS many names                 ",
         NULL
 };
 
@@ -530,6 +642,14 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
         "[kh] Kernel heap stats              ",
+        "[bc] Buffer cache stats             ",
+        "[dc] Name cache stats               ",
+#if OPT_LOCKSTAT
+        "[lockstat] Lock contention stats    ",
+#endif
+#if OPT_SCSTATS
+        "[scstats] System call stats         ",
+#endif
         "[q] Quit and shut down              ",
         NULL
 };
@@ -587,12 +707,21 @@ static struct {
 
         /* stats */
         { "kh",         cmd_kheapstats },
+        { "bc",         cmd_bufstats },
+        { "dc",         cmd_dcstats },
+#if OPT_LOCKSTAT
+        { "lockstat",   cmd_lockstat },
+#endif
+#if OPT_SCSTATS
+        { "scstats",    cmd_scstats },
+#endif
 
         /* base system tests */
         { "at",         arraytest },
         { "bt",         bitmaptest },
         { "km1",        malloctest },
         { "km2",        mallocstress },
+        { "cb",         copybench },
 #if OPT_NET
         { "net",        nettest },
 #endif
@@ -615,6 +744,8 @@ static struct {
         { "fs3",        writestress },
         { "fs4",        writestress2 },
         { "fs5",        createstress },
+        { "fs6",        readspeed },
+        { "fs7",        dirnames },
 
         { NULL, NULL }
 };
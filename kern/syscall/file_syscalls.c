@@ -1,60 +1,601 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <syscall.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <filetable.h>
 
-/* handler for write() system call                  */
 /*
- * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
+ * File-related system calls.
  *
- * You will need to improve this implementation
+ * Descriptors live in curproc->p_filetable (see filetable.h). Reads
+ * and writes go straight to the vnode through one uio over the user's
+ * buffers; the openfile's lock is held across I/O at the file offset
+ * so that processes sharing an openfile see consistent offsets.
  */
 
+/* Largest total transfer; the byte count has to fit in the int return value. */
+#define FILE_IO_MAX  0x7fffffff
+
+/*
+ * Common code for all the read and write calls: transfer between the
+ * user buffers described by IOV/IOVCNT and the file at FD. If USEPOS is
+ * set, the transfer happens at POS and the file's own offset is neither
+ * used nor changed (nor locked, so positional I/O on a shared file
+ * doesn't serialize); otherwise it happens at the file's offset, which
+ * is then advanced. IOV is updated as the transfer proceeds.
+ */
+static
 int
-sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+file_io(int fd, struct iovec *iov, unsigned iovcnt, bool usepos, off_t pos,
+	enum uio_rw rw, int *retval)
 {
-  struct iovec iov;
+  struct openfile *of;
   struct uio u;
+  struct stat st;
+  size_t total;
+  unsigned i;
   int res;
 
-  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-  
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
+  res = filetable_get(curproc->p_filetable, fd, &of);
+  if (res) {
+    return res;
+  }
+  if (of->of_accmode == (rw == UIO_READ ? O_WRONLY : O_RDONLY)) {
+    return EBADF;
   }
-  KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
-  KASSERT(curproc->p_addrspace != NULL);
 
-  /* set up a uio structure to refer to the user program's buffer (ubuf) */
-  iov.iov_ubase = ubuf;
-  iov.iov_len = nbytes;
-  u.uio_iov = &iov;
-  u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
-  u.uio_resid = nbytes;
+  total = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > FILE_IO_MAX - total) {
+      return EINVAL;
+    }
+    total += iov[i].iov_len;
+  }
+
+  if (usepos) {
+    /* fails with ESPIPE on the console and other devices that can't seek */
+    res = VOP_TRYSEEK(of->of_vnode, pos);
+    if (res) {
+      return res;
+    }
+  }
+  else {
+    lock_acquire(of->of_lock);
+    if (rw == UIO_WRITE && of->of_append) {
+      res = VOP_STAT(of->of_vnode, &st);
+      if (res) {
+        lock_release(of->of_lock);
+        return res;
+      }
+      of->of_offset = st.st_size;
+    }
+    pos = of->of_offset;
+  }
+
+  /* set up a uio structure to refer to the user program's buffers */
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_offset = pos;
+  u.uio_resid = total;
   u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
+  u.uio_rw = rw;
   u.uio_space = curproc->p_addrspace;
 
-  res = VOP_WRITE(curproc->console,&u);
+  if (rw == UIO_READ) {
+    res = VOP_READ(of->of_vnode, &u);
+  }
+  else {
+    res = VOP_WRITE(of->of_vnode, &u);
+  }
+  if (!usepos) {
+    if (!res) {
+      of->of_offset = u.uio_offset;
+    }
+    lock_release(of->of_lock);
+  }
   if (res) {
     return res;
   }
 
-  /* pass back the number of bytes actually written */
-  *retval = nbytes - u.uio_resid;
+  /* pass back the number of bytes actually transferred */
+  *retval = total - u.uio_resid;
   KASSERT(*retval >= 0);
   return 0;
 }
+
+/*
+ * Common code for readv and writev: copy in the user's iovec array.
+ * Short arrays are handled on the stack.
+ */
+#define FILE_IOV_SMALL  8
+
+static
+int
+file_iov(int fd, const_userptr_t uiov, int iovcnt, enum uio_rw rw, int *retval)
+{
+  struct iovec small[FILE_IOV_SMALL];
+  struct iovec *iov;
+  int res;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+  if (iovcnt <= FILE_IOV_SMALL) {
+    iov = small;
+  }
+  else {
+    iov = kmalloc(iovcnt * sizeof(*iov));
+    if (iov == NULL) {
+      return ENOMEM;
+    }
+  }
+
+  res = copyin(uiov, iov, iovcnt * sizeof(*iov));
+  if (!res) {
+    res = file_io(fd, iov, iovcnt, false, 0, rw, retval);
+  }
+
+  if (iov != small) {
+    kfree(iov);
+  }
+  return res;
+}
+
+/* handler for open() system call                   */
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  struct openfile *of;
+  char *path;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: open(%x,%d)\n",(unsigned int)upath,flags);
+
+  if ((flags & O_ACCMODE) == O_ACCMODE) {
+    return EINVAL;
+  }
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  res = copyinstr((const_userptr_t)upath, path, PATH_MAX, NULL);
+  if (res) {
+    kfree(path);
+    return res;
+  }
+
+  res = openfile_open(path, flags, mode, &of);
+  kfree(path);
+  if (res) {
+    return res;
+  }
+
+  res = filetable_place(curproc->p_filetable, of, retval);
+  if (res) {
+    openfile_decref(of);
+    return res;
+  }
+  return 0;
+}
+
+/* handler for read() system call                   */
+
+int
+sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  struct iovec iov;
+
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_io(fdesc, &iov, 1, false, 0, UIO_READ, retval);
+}
+
+/* handler for write() system call                  */
+
+int
+sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  struct iovec iov;
+
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_io(fdesc, &iov, 1, false, 0, UIO_WRITE, retval);
+}
+
+/* handler for pread() system call                  */
+
+int
+sys_pread(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval)
+{
+  struct iovec iov;
+
+  DEBUG(DB_SYSCALL,"Syscall: pread(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_io(fdesc, &iov, 1, true, pos, UIO_READ, retval);
+}
+
+/* handler for pwrite() system call                 */
+
+int
+sys_pwrite(int fdesc,userptr_t ubuf,unsigned int nbytes,off_t pos,int *retval)
+{
+  struct iovec iov;
+
+  DEBUG(DB_SYSCALL,"Syscall: pwrite(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  return file_io(fdesc, &iov, 1, true, pos, UIO_WRITE, retval);
+}
+
+/* handler for readv() system call                  */
+
+int
+sys_readv(int fdesc,const_userptr_t uiov,int iovcnt,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: readv(%d,%x,%d)\n",fdesc,(unsigned int)uiov,iovcnt);
+
+  return file_iov(fdesc, uiov, iovcnt, UIO_READ, retval);
+}
+
+/* handler for writev() system call                 */
+
+int
+sys_writev(int fdesc,const_userptr_t uiov,int iovcnt,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: writev(%d,%x,%d)\n",fdesc,(unsigned int)uiov,iovcnt);
+
+  return file_iov(fdesc, uiov, iovcnt, UIO_WRITE, retval);
+}
+
+/*
+ * sendfile: copy up to COUNT bytes from INFD to OUTFD inside the kernel,
+ * through one bounce buffer reused for every chunk, so the data never
+ * crosses into userspace. If UOFFSET is NULL, reading starts at (and
+ * advances) INFD's offset; otherwise it starts at the off_t UOFFSET
+ * points to, which is updated instead. Writing always goes at OUTFD's
+ * offset. Hands back the number of bytes copied, which is short only at
+ * end of file or if an error happens part way.
+ */
+#define SENDFILE_BUFSIZE  4096
+
+int
+sys_sendfile(int outfd, int infd, userptr_t uoffset, size_t count, int *retval)
+{
+  struct openfile *in, *out, *first, *second;
+  struct iovec iov;
+  struct uio u;
+  struct stat st;
+  char *buf;
+  off_t inpos, outpos;
+  size_t done, chunk, got;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: sendfile(%d,%d,%x,%d)\n",outfd,infd,
+	(unsigned int)uoffset,count);
+
+  res = filetable_get(curproc->p_filetable, infd, &in);
+  if (res) {
+    return res;
+  }
+  res = filetable_get(curproc->p_filetable, outfd, &out);
+  if (res) {
+    return res;
+  }
+  if (in->of_accmode == O_WRONLY || out->of_accmode == O_RDONLY) {
+    return EBADF;
+  }
+  if (uoffset == NULL && in == out) {
+    /* one offset can't be both the source and the destination */
+    return EINVAL;
+  }
+  if (count > FILE_IO_MAX) {
+    count = FILE_IO_MAX;
+  }
+
+  if (uoffset != NULL) {
+    res = copyin(uoffset, &inpos, sizeof(inpos));
+    if (res) {
+      return res;
+    }
+    res = VOP_TRYSEEK(in->of_vnode, inpos);
+    if (res) {
+      return res;
+    }
+  }
+
+  buf = kmalloc(SENDFILE_BUFSIZE);
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+
+  /* lock both offsets if we use both, in address order to avoid deadlock */
+  first = out;
+  second = NULL;
+  if (uoffset == NULL) {
+    first = in < out ? in : out;
+    second = in < out ? out : in;
+  }
+  lock_acquire(first->of_lock);
+  if (second != NULL) {
+    lock_acquire(second->of_lock);
+  }
+
+  if (uoffset == NULL) {
+    inpos = in->of_offset;
+  }
+  outpos = out->of_offset;
+  if (out->of_append) {
+    res = VOP_STAT(out->of_vnode, &st);
+    if (res) {
+      goto out;
+    }
+    outpos = st.st_size;
+  }
+
+  done = 0;
+  while (done < count) {
+    chunk = count - done;
+    if (chunk > SENDFILE_BUFSIZE) {
+      chunk = SENDFILE_BUFSIZE;
+    }
+
+    uio_kinit(&iov, &u, buf, chunk, inpos, UIO_READ);
+    res = VOP_READ(in->of_vnode, &u);
+    if (res) {
+      break;
+    }
+    got = chunk - u.uio_resid;
+    if (got == 0) {
+      /* end of file */
+      break;
+    }
+
+    uio_kinit(&iov, &u, buf, got, outpos, UIO_WRITE);
+    res = VOP_WRITE(out->of_vnode, &u);
+    got -= u.uio_resid;
+    inpos += got;
+    outpos += got;
+    done += got;
+    if (res || u.uio_resid > 0) {
+      break;
+    }
+  }
+
+  /* report what got through, if anything did, rather than the error */
+  if (done > 0) {
+    res = 0;
+  }
+  if (uoffset == NULL) {
+    in->of_offset = inpos;
+  }
+  out->of_offset = outpos;
+
+ out:
+  if (second != NULL) {
+    lock_release(second->of_lock);
+  }
+  lock_release(first->of_lock);
+  kfree(buf);
+
+  if (res) {
+    return res;
+  }
+  if (uoffset != NULL) {
+    res = copyout(&inpos, uoffset, sizeof(inpos));
+    if (res) {
+      return res;
+    }
+  }
+  *retval = done;
+  return 0;
+}
+
+/* handler for close() system call                  */
+
+int
+sys_close(int fdesc)
+{
+  struct openfile *of, *old;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: close(%d)\n",fdesc);
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  filetable_placeat(curproc->p_filetable, NULL, fdesc, &old);
+  KASSERT(old == of);
+  openfile_decref(old);
+  return 0;
+}
+
+/* handler for lseek() system call                  */
+
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: lseek(%d,%d,%d)\n",fdesc,(int)pos,whence);
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+
+  lock_acquire(of->of_lock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    res = VOP_STAT(of->of_vnode, &st);
+    if (res) {
+      lock_release(of->of_lock);
+      return res;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    lock_release(of->of_lock);
+    return EINVAL;
+  }
+
+  /* fails with ESPIPE on the console and other devices that can't seek */
+  res = VOP_TRYSEEK(of->of_vnode, newpos);
+  if (res) {
+    lock_release(of->of_lock);
+    return res;
+  }
+  of->of_offset = newpos;
+  lock_release(of->of_lock);
+
+  *retval = newpos;
+  return 0;
+}
+
+/* handler for dup2() system call                   */
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct openfile *of, *old;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: dup2(%d,%d)\n",oldfd,newfd);
+
+  res = filetable_get(curproc->p_filetable, oldfd, &of);
+  if (res) {
+    return res;
+  }
+  if (newfd < 0 || newfd >= OPEN_MAX) {
+    return EBADF;
+  }
+
+  if (oldfd != newfd) {
+    openfile_incref(of);
+    filetable_placeat(curproc->p_filetable, of, newfd, &old);
+    if (old != NULL) {
+      openfile_decref(old);
+    }
+  }
+  *retval = newfd;
+  return 0;
+}
+
+/* handler for fsync() system call                  */
+
+int
+sys_fsync(int fdesc)
+{
+  struct openfile *of;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: fsync(%d)\n",fdesc);
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+
+  /* our own mappings of the file go first */
+  res = as_msync(curproc->p_addrspace, of->of_vnode);
+  if (res) {
+    return res;
+  }
+  return VOP_FSYNC(of->of_vnode);
+}
+
+/* handler for mmap() system call                   */
+
+/*
+ * Map LEN bytes of the file at FD, starting at page-aligned offset POS.
+ * The address is always chosen by the kernel; ADDR is ignored. Pages
+ * are read in as they are touched. MAP_SHARED mappings are written back
+ * to the file by fsync, munmap, and exit.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fdesc,
+	 off_t pos, int *retval)
+{
+  struct openfile *of;
+  vaddr_t base;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: mmap(%d,%d,%d,%d)\n",len,prot,flags,fdesc);
+
+  (void)addr;
+
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+    return EINVAL;
+  }
+  if ((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0 ||
+      (prot & PROT_READ) == 0) {
+    return EINVAL;
+  }
+
+  res = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  if (of->of_accmode == O_WRONLY) {
+    return EACCES;
+  }
+  if (flags == MAP_SHARED && (prot & PROT_WRITE) &&
+      of->of_accmode != O_RDWR) {
+    return EACCES;
+  }
+
+  res = VOP_MMAP(of->of_vnode);
+  if (res) {
+    return res == EUNIMP ? ENODEV : res;
+  }
+
+  res = as_mmap(curproc->p_addrspace, of->of_vnode, pos, len, prot, flags,
+		&base);
+  if (res) {
+    return res;
+  }
+  *retval = (int)base;
+  return 0;
+}
+
+/* handler for munmap() system call                 */
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  DEBUG(DB_SYSCALL,"Syscall: munmap(%x,%d)\n",(unsigned int)addr,len);
+
+  return as_munmap(curproc->p_addrspace, (vaddr_t)addr, len);
+}
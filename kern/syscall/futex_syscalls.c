@@ -0,0 +1,175 @@
+/*
+ * Futex-style userlevel synchronization.
+ *
+ * A userlevel lock keeps its state in a word of user memory and only
+ * enters the kernel when it has to wait (futex_wait) or when someone
+ * may be waiting on it (futex_wake). Uncontended lock and unlock are
+ * plain userlevel atomic operations.
+ *
+ * Waiters are kept in a small hash table keyed on (address space,
+ * user address). Each bucket has its own lock and CV; the lock is
+ * what makes the value check in futex_wait atomic with respect to
+ * futex_wake.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/* Number of hash buckets. */
+#define FUTEX_HASHSIZE  32
+
+/* One thread sleeping in futex_wait. Lives on that thread's stack. */
+struct futex_waiter {
+	struct addrspace *fw_as;	/* address space of the word */
+	vaddr_t fw_addr;		/* user address of the word */
+	bool fw_woken;			/* set by futex_wake */
+	struct futex_waiter *fw_next;	/* next waiter in this bucket */
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;		/* protects fb_waiters */
+	struct cv *fb_cv;		/* waiters sleep here */
+	struct futex_waiter *fb_waiters; /* FIFO list of waiters */
+};
+
+static struct futex_bucket futex_table[FUTEX_HASHSIZE];
+
+/*
+ * Call once during system startup to allocate data structures.
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		if (futex_table[i].fb_lock == NULL) {
+			panic("futex_bootstrap: lock_create failed\n");
+		}
+		futex_table[i].fb_cv = cv_create("futex");
+		if (futex_table[i].fb_cv == NULL) {
+			panic("futex_bootstrap: cv_create failed\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, vaddr_t addr)
+{
+	unsigned h;
+
+	h = ((unsigned)(uintptr_t)as >> 4) ^ (addr >> 2);
+	h ^= h >> 16;
+	return &futex_table[h % FUTEX_HASHSIZE];
+}
+
+/*
+ * futex_wait: if the word at UADDR still contains VAL, sleep until a
+ * futex_wake on the same word. Otherwise fail with EAGAIN right away,
+ * so the caller can retry its userlevel fast path.
+ */
+int
+sys_futex_wait(userptr_t uaddr, int val)
+{
+	struct addrspace *as;
+	struct futex_bucket *fb;
+	struct futex_waiter fw, **pp;
+	int cur;
+	int result;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	as = curproc_getas();
+	fb = futex_hash(as, (vaddr_t)uaddr);
+
+	lock_acquire(fb->fb_lock);
+
+	result = copyin((const_userptr_t)uaddr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	fw.fw_as = as;
+	fw.fw_addr = (vaddr_t)uaddr;
+	fw.fw_woken = false;
+	fw.fw_next = NULL;
+	for (pp = &fb->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+		/* find the tail */
+	}
+	*pp = &fw;
+
+	/* futex_wake takes us off the list before setting fw_woken. */
+	while (!fw.fw_woken) {
+		cv_wait(fb->fb_cv, fb->fb_lock);
+	}
+
+	lock_release(fb->fb_lock);
+	return 0;
+}
+
+/*
+ * futex_wake: wake up to COUNT threads waiting on the word at UADDR,
+ * oldest first. Hands back the number actually woken.
+ */
+int
+sys_futex_wake(userptr_t uaddr, int count, int *retval)
+{
+	struct addrspace *as;
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, **pp;
+	int woken;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0 || count < 0) {
+		return EINVAL;
+	}
+
+	as = curproc_getas();
+	fb = futex_hash(as, (vaddr_t)uaddr);
+
+	lock_acquire(fb->fb_lock);
+
+	woken = 0;
+	pp = &fb->fb_waiters;
+	while (*pp != NULL && woken < count) {
+		fw = *pp;
+		if (fw->fw_as == as && fw->fw_addr == (vaddr_t)uaddr) {
+			*pp = fw->fw_next;
+			fw->fw_next = NULL;
+			fw->fw_woken = true;
+			woken++;
+		}
+		else {
+			pp = &fw->fw_next;
+		}
+	}
+
+	/*
+	 * The CV is shared by the whole bucket, so this also wakes
+	 * waiters on other words that hash here; they find fw_woken
+	 * still false and go back to sleep.
+	 */
+	if (woken > 0) {
+		cv_broadcast(fb->fb_cv, fb->fb_lock);
+	}
+
+	lock_release(fb->fb_lock);
+
+	*retval = woken;
+	return 0;
+}
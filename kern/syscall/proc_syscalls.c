@@ -61,7 +61,6 @@ sys_fork(pid_t *retval, struct trapframe *tf)
 	// Malloc address space
 	child->p_addrspace = (struct addrspace *) kmalloc(sizeof(struct addrspace));
 	if (child->p_addrspace == NULL) {
-		proctable_remove(child->p_pid);
 		proc_destroy(child);
 		return ENOMEM;
 	}
@@ -76,12 +75,11 @@ sys_fork(pid_t *retval, struct trapframe *tf)
     
     //find the next available pid
     pid_t cpid;
-    result = proctable_add(child, &cpid);
+    result = proctable_add(child, curproc->p_pid, &cpid);
     if (result) {
 		proc_destroy(child);
 		return result;
 	}
-    proctable[cpid-PID_MIN]->parent = curproc->p_pid;
     spinlock_acquire(&child->p_lock);
     child->p_pid = cpid;
     spinlock_release(&child->p_lock);
@@ -110,36 +108,261 @@ sys_fork(pid_t *retval, struct trapframe *tf)
 	return 0;
 }
 
+/*
+ * Argument strings for a new program, packed back to back in one
+ * ARG_MAX buffer. The tail of the buffer is spare room where
+ * argbuf_copyout builds the argv array, so the whole lot goes out to
+ * the new user stack in a single copyout.
+ */
+struct argbuf {
+	char *ab_buf;
+	size_t ab_len;		/* bytes of strings in ab_buf */
+	int ab_argc;
+};
+
+/*
+ * Copy in the null-terminated argv array UARGV and its strings.
+ */
+static
+int
+argbuf_copyin(userptr_t uargv, struct argbuf *ab)
+{
+	userptr_t uarg;
+	size_t got;
+	int result;
+
+	ab->ab_buf = kmalloc(ARG_MAX);
+	if (ab->ab_buf == NULL) {
+		return ENOMEM;
+	}
+	ab->ab_len = 0;
+	ab->ab_argc = 0;
+
+	while (1) {
+		result = copyin(uargv, &uarg, sizeof(uarg));
+		if (result) {
+			goto fail;
+		}
+		if (uarg == NULL) {
+			break;
+		}
+		result = copyinstr((const_userptr_t)uarg, ab->ab_buf + ab->ab_len,
+				   ARG_MAX - ab->ab_len, &got);
+		if (result) {
+			if (result == ENAMETOOLONG) {
+				result = E2BIG;
+			}
+			goto fail;
+		}
+		ab->ab_len += got;
+		ab->ab_argc++;
+		uargv += sizeof(userptr_t);
+
+		// Leave room for the argv array too
+		if (ROUNDUP(ab->ab_len, sizeof(userptr_t)) +
+		    (ab->ab_argc + 1) * sizeof(userptr_t) > ARG_MAX) {
+			result = E2BIG;
+			goto fail;
+		}
+	}
+	return 0;
+
+ fail:
+	kfree(ab->ab_buf);
+	ab->ab_buf = NULL;
+	return result;
+}
+
+/*
+ * Lay the arguments out below *STACKPTR in the current address space:
+ * the strings, then the argv array pointing at them. Hands back the new
+ * stack pointer and the user address of argv.
+ */
+static
+int
+argbuf_copyout(struct argbuf *ab, vaddr_t *stackptr, userptr_t *argv)
+{
+	userptr_t *uargs;
+	size_t strsize, total, off;
+	vaddr_t base;
+	int i;
+
+	strsize = ROUNDUP(ab->ab_len, sizeof(userptr_t));
+	total = strsize + (ab->ab_argc + 1) * sizeof(userptr_t);
+	KASSERT(total <= ARG_MAX);
+	base = (*stackptr - total) & ~(vaddr_t)7;
+
+	/* Don't hand the padding's stale heap contents to userspace */
+	bzero(ab->ab_buf + ab->ab_len, strsize - ab->ab_len);
+
+	uargs = (userptr_t *)(ab->ab_buf + strsize);
+	off = 0;
+	for (i = 0; i < ab->ab_argc; i++) {
+		uargs[i] = (userptr_t)(base + off);
+		off += strlen(ab->ab_buf + off) + 1;
+	}
+	uargs[i] = NULL;
+
+	*stackptr = base;
+	*argv = (userptr_t)(base + strsize);
+	return copyout(ab->ab_buf, (userptr_t)base, total);
+}
+
+/* What a spawned child needs to get going, handed over by sys_spawn. */
+struct spawn_args {
+	struct vnode *sa_vnode;
+	struct argbuf sa_args;
+};
+
+/*
+ * Entry point of a spawned process: load the program and go. Errors
+ * here can't be reported back to the parent any more, so they show up
+ * as an exit status of 127, the way a failed exec after fork would.
+ */
+static
+void
+spawn_entry(void *data1, unsigned long data2)
+{
+	struct spawn_args *sa = data1;
+	struct addrspace *as;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	int argc;
+	int result;
+
+	(void)data2;
+
+	as = as_create();
+	if (as == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	curproc_setas(as);
+	as_activate();
+
+	result = load_elf(sa->sa_vnode, &entrypoint);
+	if (result) {
+		goto fail;
+	}
+	result = as_define_stack(as, &stackptr);
+	if (result) {
+		goto fail;
+	}
+	result = argbuf_copyout(&sa->sa_args, &stackptr, &argv);
+	if (result) {
+		goto fail;
+	}
+
+	argc = sa->sa_args.ab_argc;
+	vfs_close(sa->sa_vnode);
+	kfree(sa->sa_args.ab_buf);
+	kfree(sa);
+
+	enter_new_process(argc, argv, stackptr, entrypoint);
+	panic("enter_new_process returned\n");
+
+ fail:
+	DEBUG(DB_SYSCALL, "spawn: %s: %s\n", curproc->p_name, strerror(result));
+	vfs_close(sa->sa_vnode);
+	kfree(sa->sa_args.ab_buf);
+	kfree(sa);
+	sys__exit(127);
+}
+
+/*
+ * Create a child running PATH with arguments ARGV, without copying the
+ * parent's address space the way fork followed by execv does. The
+ * program is opened here, so a bad path fails the call; the child then
+ * loads it itself.
+ */
+int
+sys_spawn(userptr_t path, userptr_t argv, pid_t *retval)
+{
+	struct spawn_args *sa;
+	struct proc *child;
+	char *kpath;
+	pid_t cpid;
+	int result;
+
+	kpath = kmalloc(PATH_MAX);
+	if (kpath == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr((const_userptr_t)path, kpath, PATH_MAX, NULL);
+	if (result) {
+		kfree(kpath);
+		return result;
+	}
+
+	sa = kmalloc(sizeof(*sa));
+	if (sa == NULL) {
+		kfree(kpath);
+		return ENOMEM;
+	}
+	result = argbuf_copyin(argv, &sa->sa_args);
+	if (result) {
+		kfree(sa);
+		kfree(kpath);
+		return result;
+	}
+
+	child = proc_create_runprogram(kpath);
+	if (child == NULL) {
+		result = ENOMEM;
+		goto fail_args;
+	}
+
+	/* Open the file. (vfs_open may destroy the path, so do it last.) */
+	result = vfs_open(kpath, O_RDONLY, 0, &sa->sa_vnode);
+	if (result) {
+		goto fail_proc;
+	}
+
+	result = proctable_add(child, curproc->p_pid, &cpid);
+	if (result) {
+		goto fail_vnode;
+	}
+	spinlock_acquire(&child->p_lock);
+	child->p_pid = cpid;
+	spinlock_release(&child->p_lock);
+
+	result = thread_fork("child thread", child, spawn_entry, sa, 0);
+	if (result) {
+		proctable_remove(cpid);
+		goto fail_vnode;
+	}
+
+	kfree(kpath);
+	*retval = cpid;
+	return 0;
+
+ fail_vnode:
+	vfs_close(sa->sa_vnode);
+ fail_proc:
+	proc_destroy(child);
+ fail_args:
+	kfree(sa->sa_args.ab_buf);
+	kfree(sa);
+	kfree(kpath);
+	return result;
+}
+
 void sys__exit(int exitcode) {
     struct proc *p = curproc;
 	pid_t pid = p->p_pid;
-	struct proctable_node *pt = proctable_get(pid);
 
-	// should never be null if this proc's thread still exists at this point
-	KASSERT(pt != NULL);
-    
-    
-    // Update exit code
-    lock_acquire(pt->exitlock);
-    pt->exited = true;
-    pt->exitcode = _MKWAIT_EXIT(exitcode);
-    
-    //update the proctable, curproc's children do not need to keep exitcode
-	proctable_update(pid);
-    
-	// Broadcast
-	cv_broadcast(pt->exitcv, pt->exitlock);
-    lock_release(pt->exitlock);
-    
-    //if curproc has no parent
-    if (pt->parent == -1)
-        proctable_remove(pid);
+    //publish our exit status and wake our parent, hand off our children,
+    //and free our entry if nobody will wait for it
+    proctable_exit(pid, _MKWAIT_EXIT(exitcode));
 
     as_deactivate();
 
     struct addrspace *as;
     as = curproc_setas(NULL);
-    as_destroy(as);
+    //a spawned child can fail before it has an address space
+    if (as != NULL) {
+        as_destroy(as);
+    }
 	// Detach and destroy process
 	proc_remthread(curthread);
 	proc_destroy(p);
@@ -167,34 +390,32 @@ sys_waitpid(pid_t pid,
 {  
   //invalid input
   if (status == NULL) return EFAULT;
-  if (options != 0) return EINVAL;
+  if (options & ~WNOHANG) return EINVAL;
   
-  //pid does not exist
-  struct proctable_node *child = proctable_get(pid); 
-  if (child == NULL) return ESRCH;
-	
-  if (curproc->p_pid != child->parent) return ECHILD;  //the process to wait for is not curproc's child
-
-
   int exitstatus;
   int result;
-  
-  lock_acquire(child->exitlock);
-  while (!(child->exited)) {
-      //wait if not exited
-      cv_wait(child->exitcv, child->exitlock);
+  pid_t childpid;
+
+  //pid does not exist, or is not curproc's child; otherwise wait
+  //for it (or for any child, with WAIT_ANY) unless WNOHANG
+  result = proctable_wait(curproc->p_pid, pid, options,
+			  &childpid, &exitstatus);
+  if (result) return result;
+  if (childpid == 0) {
+    //WNOHANG and nobody has exited yet
+    *retval = 0;
+    return(0);
   }
-  exitstatus = child->exitcode;
+
   result = copyout((const void *) &exitstatus, status,
 			sizeof(int));
-            
-  lock_release(child->exitlock);
-
-  
   if (result) {
 		return EFAULT;
   }
-  *retval = pid;
+
+  //status delivered, the child's entry and pid can go
+  proctable_reap(childpid);
+  *retval = childpid;
   return(0);
 }
 
@@ -202,123 +423,91 @@ int sys_execv(userptr_t program, userptr_t args) {
     //error checking
     if (program == NULL) return ENOENT;
     if (args == NULL) return EFAULT;
-    if (strlen((char *)program) > PATH_MAX) return E2BIG;
     
+    struct argbuf ab;
+    struct addrspace *as, *old;
+    struct vnode *v;
+    vaddr_t entrypoint, stackptr;
+    userptr_t argv;
+    char *local_program;
+    int argc;
     int result;
-    size_t count = 0;
-    size_t total = 0;
-    char **argsA= (char **) args;
-    
-    //count the number of arguments and check total size
-    while (argsA[count]) {
-        total += strlen(argsA[count])+1;
-        count ++;
-    }
-    if (total > ARG_MAX) return E2BIG;
-    
-    //copy arguments to kernel stack
-    char ** local_args = kmalloc((count+1)*sizeof(char *));
-    if (local_args == NULL) return ENOMEM;
-    int i = 0;
-    size_t size = 0;
-    size_t usedspace = 0;
-    char * init = kmalloc(ARG_MAX);
-    
-    while (argsA[i]) {
-        result = copyinstr((const_userptr_t) argsA[i], init+usedspace, ARG_MAX, &size);
-        local_args[i] = init+usedspace;
-        usedspace += size;
-        i++;
-        if (result) {
-            return result;
-        }
-    }
-    local_args[i] = NULL;
     
     //make a copy of the program name
-    char *local_program;
-    local_program = kstrdup((char *)program);
+    local_program = kmalloc(PATH_MAX);
     if (local_program == NULL) return ENOMEM;
+    result = copyinstr((const_userptr_t)program, local_program, PATH_MAX, NULL);
+    if (result) {
+        kfree(local_program);
+        return result;
+    }
     
-    struct addrspace *as;
-	struct vnode *v;
-	vaddr_t entrypoint, stackptr;
+    //copy the arguments into one packed kernel buffer
+    result = argbuf_copyin(args, &ab);
+    if (result) {
+        kfree(local_program);
+        return result;
+    }
+    argc = ab.ab_argc;
 
 	/* Open the file. */
 	result = vfs_open(local_program, O_RDONLY, 0, &v);
+    kfree(local_program);
 	if (result) {
+        kfree(ab.ab_buf);
 		return result;
 	}
-    kfree(local_program);
 
 	/* Create a new address space. */
 	as = as_create();
 	if (as == NULL) {
 		vfs_close(v);
+        kfree(ab.ab_buf);
 		return ENOMEM;
 	}
 
-	/* Switch to it and activate it. */
-	struct addrspace *old = curproc_setas(as);
+	/* Switch to it and activate it; keep the old one until we're sure. */
+	old = curproc_setas(as);
 	as_activate();
-    as_destroy(old);
 
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
-	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		vfs_close(v);
-		return result;
-	}
-
 	/* Done with the file now. */
 	vfs_close(v);
+	if (result) {
+        goto fail;
+	}
     
     /* Define the user stack in the address space */
 	result = as_define_stack(as, &stackptr);
 	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		return result;
+        goto fail;
 	}
     
-    //copy the argument strings to new user stack
-    vaddr_t usermodePointer[count];
-    for (int i=count-1; i >= 0 ; i--) {
-        size_t args_size = strlen(local_args[i])+1;
-        stackptr -= ROUNDUP(args_size,8);
-        result = copyoutstr(local_args[i], (userptr_t)stackptr, ARG_MAX, &size);
-        if (result) {
-            return result;
-        }
-        //the new address of arguments
-        usermodePointer[i] = stackptr;
-    }
-    usermodePointer[count] = 0;
-    
-    //copy the array to new user stack
-    for (int i=count; i >= 0 ; i--) {
-        size_t array_size = sizeof(vaddr_t);
-        stackptr -= ROUNDUP(array_size, 4);
-        result = copyout(&usermodePointer[i], (userptr_t)stackptr, array_size);
-        if (result) {
-            return result;
-        }
+    //strings and argv array go to the new user stack in one copyout
+    result = argbuf_copyout(&ab, &stackptr, &argv);
+    if (result) {
+        goto fail;
     }
     
-    kfree(init);
-    kfree(local_args);
-    
-    vaddr_t argvAddr = 0;
-    if (args) 
-        argvAddr = stackptr;
+    kfree(ab.ab_buf);
+    as_destroy(old);
     
     /* Warp to user mode. */
-	enter_new_process(count /*argc*/, (userptr_t) argvAddr /*userspace addr of argv*/,
+	enter_new_process(argc /*argc*/, argv /*userspace addr of argv*/,
 			  stackptr, entrypoint);
 	
 	/* enter_new_process does not return. */
 	panic("enter_new_process returned\n");
 	return -1;
+
+ fail:
+    //go back to the old address space so the caller can carry on
+    curproc_setas(old);
+    as_activate();
+    as_destroy(as);
+    kfree(ab.ab_buf);
+    return result;
 }
 
 #else
@@ -0,0 +1,400 @@
+/*
+ * System call statistics.
+ * The interface is described in scstats.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/syscall.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <scstats.h>
+
+/* System call numbers tracked; anything above is lumped into the last. */
+#define SCSTATS_NCALLS    128
+
+/* Histogram buckets. Bucket B counts calls that took under 2^B us. */
+#define SCSTATS_NBUCKETS  24
+
+/* CPUs tracked; any beyond share the last slot. */
+#define SCSTATS_MAXCPUS   32
+
+/* Largest report produced. */
+#define SCSTATS_REPORTMAX 32768
+
+struct scstats_call {
+	uint32_t sc_calls;
+	uint32_t sc_errors;
+	uint64_t sc_time;		/* total, in nanoseconds */
+	uint32_t sc_hist[SCSTATS_NBUCKETS];
+};
+
+/*
+ * Per-CPU counters, allocated the first time each CPU makes a system
+ * call. Each CPU only updates its own, with interrupts off so that a
+ * thread switch can't interleave two updates.
+ */
+struct scstats_cpu {
+	struct scstats_call sp_calls[SCSTATS_NCALLS];
+};
+
+static struct scstats_cpu *scstats_percpu[SCSTATS_MAXCPUS];
+static volatile bool scstats_enabled = false;
+
+/* Names of the calls we implement, for the report. */
+static const char *const scstats_names[SCSTATS_NCALLS] = {
+	[SYS_fork] = "fork",
+	[SYS_execv] = "execv",
+	[SYS__exit] = "_exit",
+	[SYS_waitpid] = "waitpid",
+	[SYS_getpid] = "getpid",
+	[SYS_mmap] = "mmap",
+	[SYS_munmap] = "munmap",
+	[SYS_open] = "open",
+	[SYS_dup2] = "dup2",
+	[SYS_close] = "close",
+	[SYS_read] = "read",
+	[SYS_pread] = "pread",
+	[SYS_readv] = "readv",
+	[SYS_write] = "write",
+	[SYS_pwrite] = "pwrite",
+	[SYS_writev] = "writev",
+	[SYS_lseek] = "lseek",
+	[SYS_fsync] = "fsync",
+	[SYS___time] = "__time",
+	[SYS_reboot] = "reboot",
+	[SYS_futex_wait] = "futex_wait",
+	[SYS_futex_wake] = "futex_wake",
+	[SYS_spawn] = "spawn",
+	[SYS_sendfile] = "sendfile",
+	[SYS_sysring_enter] = "sysring_enter",
+};
+
+static
+uint64_t
+scstats_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/*
+ * Get this CPU's counters, allocating them if need be. Returns NULL if
+ * there's no memory; those calls just go uncounted.
+ */
+static
+struct scstats_cpu *
+scstats_mycpu(void)
+{
+	struct scstats_cpu *sp, *mine;
+	unsigned n;
+	int spl;
+
+	n = curcpu->c_number;
+	if (n >= SCSTATS_MAXCPUS) {
+		n = SCSTATS_MAXCPUS - 1;
+	}
+	sp = scstats_percpu[n];
+	if (sp != NULL) {
+		return sp;
+	}
+
+	mine = kmalloc(sizeof(*mine));
+	if (mine == NULL) {
+		return NULL;
+	}
+	bzero(mine, sizeof(*mine));
+
+	/* We might have been preempted by another thread doing the same. */
+	spl = splhigh();
+	sp = scstats_percpu[n];
+	if (sp == NULL) {
+		scstats_percpu[n] = sp = mine;
+		mine = NULL;
+	}
+	splx(spl);
+
+	if (mine != NULL) {
+		kfree(mine);
+	}
+	return sp;
+}
+
+uint64_t
+scstats_enter(int callno)
+{
+	struct scstats_cpu *sp;
+	int spl;
+
+	if (!scstats_enabled) {
+		return 0;
+	}
+	sp = scstats_mycpu();
+	if (sp == NULL) {
+		return 0;
+	}
+	if (callno < 0 || callno >= SCSTATS_NCALLS) {
+		callno = SCSTATS_NCALLS - 1;
+	}
+
+	spl = splhigh();
+	/* The thread may have moved since scstats_mycpu; that's fine. */
+	sp->sp_calls[callno].sc_calls++;
+	splx(spl);
+
+	return scstats_now();
+}
+
+void
+scstats_exit(int callno, uint64_t start, int err)
+{
+	struct scstats_cpu *sp;
+	struct scstats_call *sc;
+	uint64_t ns;
+	uint32_t us;
+	unsigned b;
+	int spl;
+
+	if (start == 0) {
+		return;
+	}
+	ns = scstats_now() - start;
+	us = ns / 1000;
+	for (b = 0; b < SCSTATS_NBUCKETS - 1 && us >= ((uint32_t)1 << b); b++) {
+		/* find the bucket */
+	}
+
+	sp = scstats_mycpu();
+	if (sp == NULL) {
+		return;
+	}
+	if (callno < 0 || callno >= SCSTATS_NCALLS) {
+		callno = SCSTATS_NCALLS - 1;
+	}
+	sc = &sp->sp_calls[callno];
+
+	spl = splhigh();
+	if (err) {
+		sc->sc_errors++;
+	}
+	sc->sc_time += ns;
+	sc->sc_hist[b]++;
+	splx(spl);
+}
+
+void
+scstats_reset(void)
+{
+	unsigned i;
+	int spl;
+
+	for (i = 0; i < SCSTATS_MAXCPUS; i++) {
+		if (scstats_percpu[i] != NULL) {
+			/* Racy against other CPUs, but only by a few counts. */
+			spl = splhigh();
+			bzero(scstats_percpu[i], sizeof(*scstats_percpu[i]));
+			splx(spl);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Report.
+
+/*
+ * Sum the per-CPU counters for CALLNO into TOTAL.
+ */
+static
+void
+scstats_sum(int callno, struct scstats_call *total)
+{
+	const struct scstats_call *sc;
+	unsigned i, b;
+
+	bzero(total, sizeof(*total));
+	for (i = 0; i < SCSTATS_MAXCPUS; i++) {
+		if (scstats_percpu[i] == NULL) {
+			continue;
+		}
+		sc = &scstats_percpu[i]->sp_calls[callno];
+		total->sc_calls += sc->sc_calls;
+		total->sc_errors += sc->sc_errors;
+		total->sc_time += sc->sc_time;
+		for (b = 0; b < SCSTATS_NBUCKETS; b++) {
+			total->sc_hist[b] += sc->sc_hist[b];
+		}
+	}
+}
+
+/*
+ * Write the report into BUF (of size LEN), one line per system call
+ * that has been made: the counts, the mean time in microseconds, and
+ * the nonzero histogram buckets as "<limit_us:count". Returns the
+ * length, truncated to fit.
+ */
+static
+size_t
+scstats_format(char *buf, size_t len)
+{
+	struct scstats_call total;
+	char namebuf[16];
+	const char *name;
+	uint32_t timed;
+	size_t pos;
+	unsigned b;
+	int callno;
+
+	pos = snprintf(buf, len, "%-14s %8s %8s %10s  %s\n",
+		       "call", "calls", "errors", "mean(us)", "histogram(us)");
+
+	for (callno = 0; callno < SCSTATS_NCALLS && pos < len; callno++) {
+		scstats_sum(callno, &total);
+		if (total.sc_calls == 0) {
+			continue;
+		}
+		timed = 0;
+		for (b = 0; b < SCSTATS_NBUCKETS; b++) {
+			timed += total.sc_hist[b];
+		}
+
+		name = scstats_names[callno];
+		if (name == NULL) {
+			snprintf(namebuf, sizeof(namebuf), "#%d", callno);
+			name = namebuf;
+		}
+		pos += snprintf(buf + pos, len - pos, "%-14s %8u %8u %10lu ",
+				name, total.sc_calls, total.sc_errors,
+				timed ? (unsigned long)(total.sc_time / timed
+							/ 1000) : 0UL);
+		for (b = 0; b < SCSTATS_NBUCKETS && pos < len; b++) {
+			if (total.sc_hist[b] == 0) {
+				continue;
+			}
+			if (b == SCSTATS_NBUCKETS - 1) {
+				pos += snprintf(buf + pos, len - pos, " more:%u",
+						total.sc_hist[b]);
+			}
+			else {
+				pos += snprintf(buf + pos, len - pos, " <%u:%u",
+						1U << b, total.sc_hist[b]);
+			}
+		}
+		if (pos < len) {
+			pos += snprintf(buf + pos, len - pos, "\n");
+		}
+	}
+	return pos < len ? pos : len - 1;
+}
+
+void
+scstats_print(void)
+{
+	char *buf;
+
+	buf = kmalloc(SCSTATS_REPORTMAX);
+	if (buf == NULL) {
+		kprintf("scstats: Out of memory\n");
+		return;
+	}
+	scstats_format(buf, SCSTATS_REPORTMAX);
+	kprintf("%s", buf);
+	kfree(buf);
+}
+
+////////////////////////////////////////////////////////////
+//
+// The scstats: device. Reading it produces the same report as the
+// menu command; it's generated afresh on every read.
+
+static
+int
+scstatsopen(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+scstatsclose(struct device *dev)
+{
+	(void)dev;
+	return 0;
+}
+
+static
+int
+scstatsio(struct device *dev, struct uio *uio)
+{
+	char *buf;
+	size_t len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		return EINVAL;
+	}
+
+	buf = kmalloc(SCSTATS_REPORTMAX);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	len = scstats_format(buf, SCSTATS_REPORTMAX);
+
+	result = 0;
+	if (uio->uio_offset >= 0 && uio->uio_offset < (off_t)len) {
+		result = uiomove(buf + uio->uio_offset,
+				 len - uio->uio_offset, uio);
+	}
+	kfree(buf);
+	return result;
+}
+
+static
+int
+scstatsioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+void
+scstats_bootstrap(void)
+{
+	struct device *dev;
+	int result;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev == NULL) {
+		panic("Could not add scstats device: out of memory\n");
+	}
+	dev->d_open = scstatsopen;
+	dev->d_close = scstatsclose;
+	dev->d_io = scstatsio;
+	dev->d_ioctl = scstatsioctl;
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+	dev->d_data = NULL;
+
+	result = vfs_adddev("scstats", dev, 0);
+	if (result) {
+		panic("Could not add scstats device: %s\n", strerror(result));
+	}
+
+	scstats_enabled = true;
+}
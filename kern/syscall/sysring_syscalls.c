@@ -0,0 +1,201 @@
+/*
+ * Batched system calls.
+ *
+ * sysring_enter runs the operations a program has queued in a struct
+ * sysring (see <kern/sysring.h>) in one kernel entry, so programs that
+ * make lots of small calls pay for the trap once per batch instead of
+ * once per call.
+ *
+ * Submissions are copied in and completions copied out in bulk, a
+ * chunk at a time; the ring header is read once at the start and
+ * written once at the end.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/sysring.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/* Entries handled per bulk copy; bounds the kernel stack used. */
+#define SYSRING_CHUNK  16
+
+/* User address of field FIELD of the ring at URING. */
+#define SYSRING_UADDR(uring, field) \
+	((userptr_t)&((struct sysring *)(uring))->field)
+
+/*
+ * Run one operation and fill in its completion.
+ */
+static
+void
+sysring_run(const struct sysring_sqe *sqe, struct sysring_cqe *cqe)
+{
+	int32_t retval = 0;
+	int err;
+
+	switch (sqe->sqe_op) {
+	    case SYSRING_OP_NOP:
+		err = 0;
+		break;
+
+	    case SYSRING_OP_WRITE:
+		err = sys_write(sqe->sqe_args[0],
+				(userptr_t)sqe->sqe_args[1],
+				sqe->sqe_args[2],
+				&retval);
+		break;
+
+	    case SYSRING_OP_READ:
+		err = sys_read(sqe->sqe_args[0],
+			       (userptr_t)sqe->sqe_args[1],
+			       sqe->sqe_args[2],
+			       &retval);
+		break;
+
+	    case SYSRING_OP_GETPID:
+		err = sys_getpid((pid_t *)&retval);
+		break;
+
+	    case SYSRING_OP_WAITPID:
+		err = sys_waitpid(sqe->sqe_args[0],
+				  (userptr_t)sqe->sqe_args[1],
+				  sqe->sqe_args[2],
+				  (pid_t *)&retval);
+		break;
+
+	    default:
+		err = ENOSYS;
+		break;
+	}
+
+	cqe->cqe_user = sqe->sqe_user;
+	cqe->cqe_result = err ? -1 : retval;
+	cqe->cqe_error = err;
+}
+
+/*
+ * Copy NUM ring entries of SIZE bytes each between the kernel array
+ * KBUF and the user ring array at UARRAY, starting at counter value
+ * FIRST and wrapping around the end of the ring if need be.
+ */
+static
+int
+sysring_copy(userptr_t uarray, void *kbuf, size_t size,
+	     uint32_t first, unsigned num, bool out)
+{
+	unsigned slot, n1;
+	int result;
+
+	slot = first % SYSRING_ENTRIES;
+	n1 = SYSRING_ENTRIES - slot;
+	if (n1 > num) {
+		n1 = num;
+	}
+
+	if (out) {
+		result = copyout(kbuf, uarray + slot * size, n1 * size);
+	}
+	else {
+		result = copyin(uarray + slot * size, kbuf, n1 * size);
+	}
+	if (result || n1 == num) {
+		return result;
+	}
+
+	if (out) {
+		return copyout((char *)kbuf + n1 * size, uarray,
+			       (num - n1) * size);
+	}
+	return copyin(uarray, (char *)kbuf + n1 * size, (num - n1) * size);
+}
+
+/*
+ * sysring_enter: run up to MAX queued operations from the ring at
+ * URING, stopping early if the completion queue fills up. Hands back
+ * the number run. Failures of individual operations are reported in
+ * their completions, not here. If the ring itself can't be read or
+ * written, the call fails; operations that already ran stay consumed.
+ */
+int
+sys_sysring_enter(userptr_t uring, unsigned max, int *retval)
+{
+	struct sysring_sqe sqes[SYSRING_CHUNK];
+	struct sysring_cqe cqes[SYSRING_CHUNK];
+	uint32_t hdr[4];	/* sq_head, sq_tail, cq_head, cq_tail */
+	unsigned num, chunk, i, done;
+	int result;
+
+	if ((vaddr_t)uring % sizeof(uint32_t) != 0) {
+		return EINVAL;
+	}
+
+	result = copyin(uring, hdr, sizeof(hdr));
+	if (result) {
+		return result;
+	}
+	if (hdr[1] - hdr[0] > SYSRING_ENTRIES ||
+	    hdr[3] - hdr[2] > SYSRING_ENTRIES) {
+		/* the program has scribbled on the counters */
+		return EINVAL;
+	}
+
+	/* As many as asked for, are queued, and have room to complete. */
+	num = hdr[1] - hdr[0];
+	if (num > max) {
+		num = max;
+	}
+	if (num > SYSRING_ENTRIES - (hdr[3] - hdr[2])) {
+		num = SYSRING_ENTRIES - (hdr[3] - hdr[2]);
+	}
+
+	result = 0;
+	done = 0;
+	while (done < num) {
+		chunk = num - done;
+		if (chunk > SYSRING_CHUNK) {
+			chunk = SYSRING_CHUNK;
+		}
+
+		result = sysring_copy(SYSRING_UADDR(uring, sr_sq[0]), sqes,
+				      sizeof(sqes[0]), hdr[0], chunk, false);
+		if (result) {
+			break;
+		}
+		for (i = 0; i < chunk; i++) {
+			sysring_run(&sqes[i], &cqes[i]);
+		}
+		/* They've run, so they're consumed whatever happens next. */
+		hdr[0] += chunk;
+		done += chunk;
+
+		result = sysring_copy(SYSRING_UADDR(uring, sr_cq[0]), cqes,
+				      sizeof(cqes[0]), hdr[3], chunk, true);
+		if (result) {
+			break;
+		}
+		hdr[3] += chunk;
+	}
+
+	if (done > 0) {
+		int result2;
+
+		result2 = copyout(&hdr[0], SYSRING_UADDR(uring, sr_sq_head),
+				  sizeof(uint32_t));
+		if (!result2) {
+			result2 = copyout(&hdr[3],
+					  SYSRING_UADDR(uring, sr_cq_tail),
+					  sizeof(uint32_t));
+		}
+		if (!result) {
+			result = result2;
+		}
+	}
+	if (result) {
+		return result;
+	}
+
+	*retval = done;
+	return 0;
+}
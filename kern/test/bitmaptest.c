@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,21 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* bitmap_alloc_near looks from the goal on, then wraps around. */
+	bitmap_unmark(b, 10);
+	bitmap_unmark(b, TESTSIZE-1);
+	KASSERT(bitmap_alloc_near(b, 11, &x)==0);
+	KASSERT(x == TESTSIZE-1);
+	KASSERT(bitmap_alloc_near(b, 11, &x)==0);
+	KASSERT(x == 10);
+	KASSERT(bitmap_alloc_near(b, 0, &x)==ENOSPC);
+
+	/* Changes made through the raw data are noticed too. */
+	((unsigned char *)bitmap_getdata(b))[3] &= ~1;
+	KASSERT(bitmap_alloc(b, &x)==0);
+	KASSERT(x == 24);
+	KASSERT(bitmap_alloc(b, &x)==ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,183 @@
+/*
+ * Benchmark for copyin, copyout, and copyinstr.
+ *
+ * Gives the menu thread a scratch address space, then times copies of
+ * 16 bytes through 64K in and out of it and prints the rates in MB/s
+ * (millions of bytes per second). Each measurement copies about 4M in
+ * total, so the small sizes show the fixed cost per call and the large
+ * ones the cost per byte.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <test.h>
+
+/* Where the scratch buffer goes in the address space. */
+#define CB_TEXTBASE   0x400000
+#define CB_USERBASE   0x500000
+
+#define CB_MINSIZE    16
+#define CB_MAXSIZE    65536
+#define CB_TOTAL      (4*1024*1024)
+
+static
+uint64_t
+cb_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+cb_fill(char *buf, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = 'x';
+	}
+}
+
+/* Bytes per nanosecond, times 1000, is MB/s. */
+static
+unsigned long
+cb_rate(uint64_t bytes, uint64_t start)
+{
+	uint64_t ns;
+
+	ns = cb_now() - start;
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (unsigned long)(bytes * 1000 / ns);
+}
+
+/*
+ * Time the three copies at SIZE bytes. Returns an error if any copy
+ * fails, which would mean the scratch address space isn't working.
+ */
+static
+int
+cb_measure(userptr_t ubuf, char *kbuf, size_t size)
+{
+	unsigned long inrate, outrate, strrate;
+	unsigned i, count;
+	uint64_t start;
+	size_t got;
+	int result;
+
+	count = CB_TOTAL / size;
+
+	start = cb_now();
+	for (i=0; i<count; i++) {
+		result = copyout(kbuf, ubuf, size);
+		if (result) {
+			return result;
+		}
+	}
+	outrate = cb_rate((uint64_t)count * size, start);
+
+	start = cb_now();
+	for (i=0; i<count; i++) {
+		result = copyin(ubuf, kbuf, size);
+		if (result) {
+			return result;
+		}
+	}
+	inrate = cb_rate((uint64_t)count * size, start);
+
+	/* A string that fills the whole buffer. */
+	cb_fill(kbuf, size - 1);
+	kbuf[size - 1] = 0;
+	result = copyout(kbuf, ubuf, size);
+	if (result) {
+		return result;
+	}
+	start = cb_now();
+	for (i=0; i<count; i++) {
+		result = copyinstr(ubuf, kbuf, size, &got);
+		if (result) {
+			return result;
+		}
+	}
+	strrate = cb_rate((uint64_t)count * size, start);
+	KASSERT(got == size);
+
+	kprintf("%8u %10lu %10lu %10lu\n", (unsigned)size,
+		inrate, outrate, strrate);
+	return 0;
+}
+
+int
+copybench(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	char *kbuf;
+	size_t size;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kbuf = kmalloc(CB_MAXSIZE);
+	if (kbuf == NULL) {
+		kprintf("copybench: Out of memory\n");
+		return ENOMEM;
+	}
+	cb_fill(kbuf, CB_MAXSIZE);
+
+	as = as_create();
+	if (as == NULL) {
+		kfree(kbuf);
+		kprintf("copybench: Out of memory\n");
+		return ENOMEM;
+	}
+	/* dumbvm wants two regions; only the second is used. */
+	result = as_define_region(as, CB_TEXTBASE, PAGE_SIZE, 1, 0, 0);
+	if (!result) {
+		result = as_define_region(as, CB_USERBASE, CB_MAXSIZE,
+					  1, 1, 0);
+	}
+	if (!result) {
+		result = as_prepare_load(as);
+	}
+	if (!result) {
+		result = as_complete_load(as);
+	}
+	if (result) {
+		as_destroy(as);
+		kfree(kbuf);
+		kprintf("copybench: %s\n", strerror(result));
+		return result;
+	}
+
+	oldas = curproc_setas(as);
+	as_activate();
+
+	kprintf("%8s %10s %10s %10s   (MB/s)\n", "size",
+		"copyin", "copyout", "copyinstr");
+	result = 0;
+	for (size = CB_MINSIZE; size <= CB_MAXSIZE && !result; size *= 4) {
+		result = cb_measure((userptr_t)CB_USERBASE, kbuf, size);
+	}
+	if (result) {
+		kprintf("copybench: %s\n", strerror(result));
+	}
+
+	/* Flush the scratch mappings from this CPU's TLB before freeing. */
+	as_activate();
+	curproc_setas(oldas);
+	as_destroy(as);
+	kfree(kbuf);
+	return result;
+}
@@ -36,6 +36,12 @@
  *
  * The length of SLOGAN is intentionally a prime number and 
  * specifically *not* a power of two.
+ *
+ * readspeed (fs6) instead times sequential reads of a larger file,
+ * from disk with and without read-ahead, and from the buffer cache.
+ *
+ * dirnames (fs7) puts more names in one directory than its hash
+ * buckets can hold, and checks they can all be found and removed.
  */
 
 #include <types.h>
@@ -48,6 +54,8 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <clock.h>
+#include <buf.h>
 #include <test.h>
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
@@ -55,6 +63,9 @@
 #define NCHUNKS  720
 #define NTHREADS 12
 #define NCREATES 32
+#define SPEEDSIZE  (64*1024)
+#define SPEEDCHUNK 512
+#define NDIRNAMES  600
 
 static struct semaphore *threadsem = NULL;
 
@@ -537,6 +548,250 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+static
+int
+readspeed_write(const char *fs, const char *namesuffix)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char name[32];
+	char buf[32];
+	char *data;
+	off_t pos;
+	int err;
+	unsigned i;
+
+	MAKENAME();
+
+	data = kmalloc(SPEEDCHUNK);
+	if (data == NULL) {
+		kprintf("readspeed: Out of memory\n");
+		return -1;
+	}
+	for (i=0; i<SPEEDCHUNK; i++) {
+		data[i] = SLOGAN[i % strlen(SLOGAN)];
+	}
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for write: %s\n",
+			name, strerror(err));
+		kfree(data);
+		return -1;
+	}
+
+	for (pos = 0; pos < SPEEDSIZE; pos = ku.uio_offset) {
+		uio_kinit(&iov, &ku, data, SPEEDCHUNK, pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("%s: Write error: %s\n", name,
+				err ? strerror(err) : "short write");
+			vfs_close(vn);
+			vfs_remove(name);
+			kfree(data);
+			return -1;
+		}
+	}
+
+	vfs_close(vn);
+	kfree(data);
+	return 0;
+}
+
+/*
+ * Read the whole file sequentially, SPEEDCHUNK bytes at a time, and
+ * print the rate.
+ */
+static
+int
+readspeed_read(const char *fs, const char *namesuffix, const char *what)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char name[32];
+	char buf[32];
+	char *data;
+	off_t pos;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	uint64_t ns;
+	int err;
+
+	MAKENAME();
+
+	data = kmalloc(SPEEDCHUNK);
+	if (data == NULL) {
+		kprintf("readspeed: Out of memory\n");
+		return -1;
+	}
+
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open test file for read: %s\n",
+			strerror(err));
+		kfree(data);
+		return -1;
+	}
+
+	gettime(&secs1, &nsecs1);
+	for (pos = 0; pos < SPEEDSIZE; pos = ku.uio_offset) {
+		uio_kinit(&iov, &ku, data, SPEEDCHUNK, pos, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("%s: Read error: %s\n", name,
+				err ? strerror(err) : "short read");
+			vfs_close(vn);
+			kfree(data);
+			return -1;
+		}
+	}
+	gettime(&secs2, &nsecs2);
+
+	vfs_close(vn);
+	kfree(data);
+
+	ns = (secs2 - secs1) * 1000000000ULL + nsecs2 - nsecs1;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("%s: %-24s %8lu KB/s\n", name, what,
+		(unsigned long)((uint64_t)SPEEDSIZE * 1000000000 / ns / 1024));
+	return 0;
+}
+
+static
+void
+doreadspeed(const char *filesys)
+{
+	bool oldra;
+	int bad;
+
+	kprintf("*** Starting fs read speed test on %s:\n", filesys);
+
+	if (readspeed_write(filesys, ".speed")) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	/* buffer_purge empties the cache, so the first two reads are cold. */
+	oldra = buffer_setreadahead(false);
+	bad = buffer_purge() ||
+		readspeed_read(filesys, ".speed", "disk, no read-ahead");
+	buffer_setreadahead(true);
+	bad = bad || buffer_purge() ||
+		readspeed_read(filesys, ".speed", "disk, read-ahead");
+	bad = bad || readspeed_read(filesys, ".speed", "cached");
+	buffer_setreadahead(oldra);
+
+	if (fstest_remove(filesys, ".speed") || bad) {
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	kprintf("*** fs read speed test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Create, look up, and remove one of the dirnames files. WHAT is 0 to
+ * create it, 1 to check it's there, and 2 to remove it and check it's
+ * gone.
+ */
+static
+int
+dirnames_one(const char *fs, int n, int what)
+{
+	struct vnode *vn;
+	char namesuffix[16];
+	char name[32];
+	char buf[32];
+	int err;
+
+	snprintf(namesuffix, sizeof(namesuffix), ".d%d", n);
+	MAKENAME();
+
+	switch (what) {
+	    case 0:
+		strcpy(buf, name);
+		err = vfs_open(buf, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn);
+		if (err) {
+			kprintf("Could not create %s: %s\n", name,
+				strerror(err));
+			return -1;
+		}
+		vfs_close(vn);
+		break;
+	    case 1:
+		strcpy(buf, name);
+		err = vfs_open(buf, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn);
+		if (err != EEXIST) {
+			kprintf("%s: exclusive create: %s\n", name,
+				err ? strerror(err) : "succeeded");
+			if (err == 0) {
+				vfs_close(vn);
+			}
+			return -1;
+		}
+		strcpy(buf, name);
+		err = vfs_open(buf, O_RDONLY, 0664, &vn);
+		if (err) {
+			kprintf("Could not open %s: %s\n", name,
+				strerror(err));
+			return -1;
+		}
+		vfs_close(vn);
+		break;
+	    case 2:
+		strcpy(buf, name);
+		err = vfs_remove(buf);
+		if (err) {
+			kprintf("Could not remove %s: %s\n", name,
+				strerror(err));
+			return -1;
+		}
+		strcpy(buf, name);
+		err = vfs_open(buf, O_RDONLY, 0664, &vn);
+		if (err != ENOENT) {
+			kprintf("%s: open after remove: %s\n", name,
+				err ? strerror(err) : "succeeded");
+			if (err == 0) {
+				vfs_close(vn);
+			}
+			return -1;
+		}
+		break;
+	}
+	return 0;
+}
+
+static
+void
+dodirnames(const char *filesys)
+{
+	int i, what;
+
+	kprintf("*** Starting fs many names test on %s:\n", filesys);
+
+	for (what=0; what<3; what++) {
+		for (i=0; i<NDIRNAMES; i++) {
+			if (dirnames_one(filesys, i, what)) {
+				kprintf("*** Test failed\n");
+				return;
+			}
+		}
+	}
+
+	kprintf("*** fs many names test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -544,7 +799,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[1234567] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -576,6 +831,8 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(readspeed);
+DEFTEST(dirnames);
 
 ////////////////////////////////////////////////////////////
 
@@ -0,0 +1,304 @@
+/*
+ * Lock contention profiling.
+ * The interface is described in lockstat.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
+
+/* Size of the class table. Should be a power of two. */
+#define LOCKSTAT_MAX      128
+
+/* Longest class name kept, including the terminating null. */
+#define LOCKSTAT_NAMELEN  24
+
+struct lockstat {
+	bool ls_inuse;			/* slot has been claimed */
+	int ls_kind;			/* LOCKSTAT_* */
+	char ls_name[LOCKSTAT_NAMELEN];	/* class name */
+	struct spinlock ls_lock;	/* protects the counters */
+	unsigned ls_acquires;		/* total acquisitions */
+	unsigned ls_contended;		/* acquisitions that had to wait */
+	uint64_t ls_waittime;		/* total wait, in nanoseconds */
+	uint64_t ls_maxhold;		/* longest hold, in nanoseconds */
+};
+
+/*
+ * The class table. Classes are never freed, so the pointers handed
+ * out by lockstat_get stay valid after the lock that asked for them
+ * has been destroyed.
+ *
+ * None of the spinlocks here are named, so they are not themselves
+ * profiled; this is what keeps the hooks from recursing.
+ */
+static struct lockstat lockstats[LOCKSTAT_MAX];
+static struct lockstat lockstat_other;
+static struct spinlock lockstat_table_lock = SPINLOCK_INITIALIZER;
+
+volatile bool lockstat_enabled = false;
+
+static const char *const lockstat_kindnames[] = {
+	"lock",
+	"spin",
+	"wchan",
+};
+
+static
+void
+lockstat_initclass(struct lockstat *ls, int kind, const char *name)
+{
+	ls->ls_inuse = true;
+	ls->ls_kind = kind;
+	strcpy(ls->ls_name, name);
+	spinlock_init(&ls->ls_lock);
+	ls->ls_acquires = 0;
+	ls->ls_contended = 0;
+	ls->ls_waittime = 0;
+	ls->ls_maxhold = 0;
+}
+
+void
+lockstat_bootstrap(void)
+{
+	lockstat_enabled = true;
+}
+
+struct lockstat *
+lockstat_get(int kind, const char *name)
+{
+	char buf[LOCKSTAT_NAMELEN];
+	struct lockstat *ls;
+	unsigned hash, i, slot;
+
+	KASSERT(kind >= LOCKSTAT_LOCK && kind <= LOCKSTAT_WCHAN);
+
+	/* Truncate the name to what we'll store, and hash it. */
+	hash = kind;
+	for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i] != 0; i++) {
+		buf[i] = name[i];
+		hash = hash*33 + (unsigned char)name[i];
+	}
+	buf[i] = 0;
+
+	spinlock_acquire(&lockstat_table_lock);
+	for (i=0; i<LOCKSTAT_MAX; i++) {
+		slot = (hash + i) % LOCKSTAT_MAX;
+		ls = &lockstats[slot];
+		if (!ls->ls_inuse) {
+			lockstat_initclass(ls, kind, buf);
+			spinlock_release(&lockstat_table_lock);
+			return ls;
+		}
+		if (ls->ls_kind == kind && !strcmp(ls->ls_name, buf)) {
+			spinlock_release(&lockstat_table_lock);
+			return ls;
+		}
+	}
+
+	/* Table is full. */
+	if (!lockstat_other.ls_inuse) {
+		lockstat_initclass(&lockstat_other, LOCKSTAT_LOCK, "(other)");
+	}
+	spinlock_release(&lockstat_table_lock);
+	return &lockstat_other;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockstat_enabled) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+uint64_t
+lockstat_acquired(struct lockstat *ls, uint64_t waitstart)
+{
+	uint64_t now;
+
+	now = lockstat_now();
+	if (now == 0) {
+		return 0;
+	}
+
+	spinlock_acquire(&ls->ls_lock);
+	ls->ls_acquires++;
+	if (waitstart != 0) {
+		ls->ls_contended++;
+		ls->ls_waittime += now - waitstart;
+	}
+	spinlock_release(&ls->ls_lock);
+
+	return now;
+}
+
+void
+lockstat_released(struct lockstat *ls, uint64_t holdstart)
+{
+	uint64_t now;
+
+	if (holdstart == 0) {
+		/* Acquired while we weren't looking. */
+		return;
+	}
+	now = lockstat_now();
+	if (now == 0) {
+		return;
+	}
+
+	spinlock_acquire(&ls->ls_lock);
+	if (now - holdstart > ls->ls_maxhold) {
+		ls->ls_maxhold = now - holdstart;
+	}
+	spinlock_release(&ls->ls_lock);
+}
+
+void
+lockstat_slept(struct lockstat *ls, uint64_t sleepstart)
+{
+	uint64_t now, slept;
+
+	if (sleepstart == 0) {
+		return;
+	}
+	now = lockstat_now();
+	if (now == 0) {
+		return;
+	}
+	slept = now - sleepstart;
+
+	spinlock_acquire(&ls->ls_lock);
+	ls->ls_acquires++;
+	ls->ls_contended++;
+	ls->ls_waittime += slept;
+	if (slept > ls->ls_maxhold) {
+		ls->ls_maxhold = slept;
+	}
+	spinlock_release(&ls->ls_lock);
+}
+
+static
+void
+lockstat_zero(struct lockstat *ls)
+{
+	spinlock_acquire(&ls->ls_lock);
+	ls->ls_acquires = 0;
+	ls->ls_contended = 0;
+	ls->ls_waittime = 0;
+	ls->ls_maxhold = 0;
+	spinlock_release(&ls->ls_lock);
+}
+
+void
+lockstat_reset(void)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_MAX; i++) {
+		if (lockstats[i].ls_inuse) {
+			lockstat_zero(&lockstats[i]);
+		}
+	}
+	if (lockstat_other.ls_inuse) {
+		lockstat_zero(&lockstat_other);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Report.
+
+/* Copy of a class's counters, taken so we can print without locks. */
+struct lockstat_snap {
+	const struct lockstat *lss_class;
+	unsigned lss_acquires;
+	unsigned lss_contended;
+	uint64_t lss_waittime;
+	uint64_t lss_maxhold;
+};
+
+static
+void
+lockstat_snapshot(struct lockstat *ls, struct lockstat_snap *snap)
+{
+	snap->lss_class = ls;
+	spinlock_acquire(&ls->ls_lock);
+	snap->lss_acquires = ls->ls_acquires;
+	snap->lss_contended = ls->ls_contended;
+	snap->lss_waittime = ls->ls_waittime;
+	snap->lss_maxhold = ls->ls_maxhold;
+	spinlock_release(&ls->ls_lock);
+}
+
+/*
+ * Print every class that has been acquired at least once, sorted by
+ * total wait time and then by number of acquisitions. Times are shown
+ * in microseconds.
+ */
+void
+lockstat_print(void)
+{
+	struct lockstat_snap *snaps, tmp;
+	unsigned i, j, num;
+
+	snaps = kmalloc((LOCKSTAT_MAX + 1) * sizeof(*snaps));
+	if (snaps == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	num = 0;
+	for (i=0; i<LOCKSTAT_MAX; i++) {
+		if (lockstats[i].ls_inuse) {
+			lockstat_snapshot(&lockstats[i], &snaps[num]);
+			if (snaps[num].lss_acquires > 0) {
+				num++;
+			}
+		}
+	}
+	if (lockstat_other.ls_inuse) {
+		lockstat_snapshot(&lockstat_other, &snaps[num]);
+		if (snaps[num].lss_acquires > 0) {
+			num++;
+		}
+	}
+
+	/* Insertion sort; the table is small. */
+	for (i=1; i<num; i++) {
+		tmp = snaps[i];
+		for (j=i; j>0; j--) {
+			if (snaps[j-1].lss_waittime > tmp.lss_waittime ||
+			    (snaps[j-1].lss_waittime == tmp.lss_waittime &&
+			     snaps[j-1].lss_acquires >= tmp.lss_acquires)) {
+				break;
+			}
+			snaps[j] = snaps[j-1];
+		}
+		snaps[j] = tmp;
+	}
+
+	kprintf("%-5s %-23s %10s %10s %12s %12s\n", "kind", "name",
+		"acquires", "contended", "wait(us)", "maxhold(us)");
+	for (i=0; i<num; i++) {
+		kprintf("%-5s %-23s %10u %10u %12lu %12lu\n",
+			lockstat_kindnames[snaps[i].lss_class->ls_kind],
+			snaps[i].lss_class->ls_name,
+			snaps[i].lss_acquires,
+			snaps[i].lss_contended,
+			(unsigned long)(snaps[i].lss_waittime / 1000),
+			(unsigned long)(snaps[i].lss_maxhold / 1000));
+	}
+	if (!lockstat_enabled) {
+		kprintf("(lockstat is off)\n");
+	}
+
+	kfree(snaps);
+}
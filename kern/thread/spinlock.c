@@ -36,6 +36,7 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <lockstat.h>
 
 /*
  * Spinlocks.
@@ -50,6 +51,26 @@ spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_name = NULL;
+	lk->lk_stat = NULL;
+	lk->lk_holdstart = 0;
+#endif
+}
+
+/*
+ * Name spinlock for profiling.
+ */
+void
+spinlock_setname(struct spinlock *lk, const char *name)
+{
+#if OPT_LOCKSTAT
+	lk->lk_name = name;
+	lk->lk_stat = NULL;
+#else
+	(void)lk;
+	(void)name;
+#endif
 }
 
 /*
@@ -73,6 +94,10 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+#if OPT_LOCKSTAT
+	bool profiled;
+	uint64_t waitstart = 0;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,6 +112,10 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+#if OPT_LOCKSTAT
+	profiled = lk->lk_name != NULL && lockstat_enabled;
+#endif
+
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -98,16 +127,29 @@ spinlock_acquire(struct spinlock *lk)
 		 * previously unheld and we now own it. If it was 1,
 		 * we don't.
 		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+		if (spinlock_data_get(&lk->lk_lock) != 0 ||
+		    spinlock_data_testandset(&lk->lk_lock) != 0) {
+#if OPT_LOCKSTAT
+			if (profiled && waitstart == 0) {
+				waitstart = lockstat_now();
+			}
+#endif
 			continue;
 		}
 		break;
 	}
 
 	lk->lk_holder = mycpu;
+
+#if OPT_LOCKSTAT
+	if (profiled) {
+		if (lk->lk_stat == NULL) {
+			lk->lk_stat = lockstat_get(LOCKSTAT_SPINLOCK,
+						   lk->lk_name);
+		}
+		lk->lk_holdstart = lockstat_acquired(lk->lk_stat, waitstart);
+	}
+#endif
 }
 
 /*
@@ -121,6 +163,13 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	if (lk->lk_holdstart != 0) {
+		lockstat_released(lk->lk_stat, lk->lk_holdstart);
+		lk->lk_holdstart = 0;
+	}
+#endif
+
 	lk->lk_holder = NULL;
 	spinlock_data_set(&lk->lk_lock, 0);
 	spllower(IPL_HIGH, IPL_NONE);
@@ -39,6 +39,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <lockstat.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -173,6 +174,10 @@ lock_create(const char *name)
         spinlock_init(&lock->lk_lock);
         lock->locked = false;
         lock->lk_holder = NULL;
+#if OPT_LOCKSTAT
+        lock->lk_stat = lockstat_get(LOCKSTAT_LOCK, name);
+        lock->lk_holdstart = 0;
+#endif
 
         return lock;
 }
@@ -195,6 +200,9 @@ lock_acquire(struct lock *lock)
 {
         // Write this
         struct thread *mythread;
+#if OPT_LOCKSTAT
+        uint64_t waitstart;
+#endif
 
 
         if (CURCPU_EXISTS()) {
@@ -208,6 +216,10 @@ lock_acquire(struct lock *lock)
         }
 
         spinlock_acquire(&lock->lk_lock);
+
+#if OPT_LOCKSTAT
+        waitstart = lock->locked ? lockstat_now() : 0;
+#endif
         
         while (lock->locked) {
             wchan_lock(lock->lk_wchan);
@@ -218,6 +230,9 @@ lock_acquire(struct lock *lock)
 
         lock->locked = true;
         lock->lk_holder = mythread;
+#if OPT_LOCKSTAT
+        lock->lk_holdstart = lockstat_acquired(lock->lk_stat, waitstart);
+#endif
         spinlock_release(&lock->lk_lock);
 }
 
@@ -230,6 +245,10 @@ lock_release(struct lock *lock)
         }
 
         spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKSTAT
+        lockstat_released(lock->lk_stat, lock->lk_holdstart);
+        lock->lk_holdstart = 0;
+#endif
         lock->lk_holder = NULL;
         lock->locked = false;
         wchan_wakeall(lock->lk_wchan);
@@ -295,8 +314,12 @@ void
 cv_wait(struct cv *cv, struct lock *lock)
 {
         // Write this
-        lock_release(lock);
+        /*
+         * Lock the wchan before letting go of the lock, so a
+         * signal sent in between can't be lost.
+         */
         wchan_lock(cv->cv_wchan);
+        lock_release(lock);
         wchan_sleep(cv->cv_wchan);
         lock_acquire(lock);
 }
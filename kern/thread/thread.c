@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <lockstat.h>
 
 #include "opt-synchprobs.h"
 
@@ -62,6 +63,9 @@ struct wchan {
 	const char *wc_name;		/* name for this channel */
 	struct threadlist wc_threads;	/* list of waiting threads */
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
+#if OPT_LOCKSTAT
+	struct lockstat *wc_stat;	/* profiling class */
+#endif
 };
 
 /* Master array of CPUs. */
@@ -184,6 +188,7 @@ cpu_create(unsigned hardware_number)
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -464,6 +469,51 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Make all the threads on LIST runnable, leaving LIST empty.
+ *
+ * Threads headed for the same cpu are gathered up first and spliced
+ * onto that cpu's run queue in one go, so each target run queue is
+ * locked only once and gets at most one IPI.
+ */
+static
+void
+thread_make_runnable_list(struct threadlist *list)
+{
+	struct threadlist batch;
+	struct thread *t, *next;
+	struct cpu *targetcpu;
+
+	threadlist_init(&batch);
+
+	while (!threadlist_isempty(list)) {
+		/* Pull out every thread bound for the first one's cpu. */
+		t = list->tl_head.tln_next->tln_self;
+		targetcpu = t->t_cpu;
+		for (; t != NULL; t = next) {
+			/* the tail bookend has a null tln_self */
+			next = t->t_listnode.tln_next->tln_self;
+			if (t->t_cpu == targetcpu) {
+				threadlist_remove(list, t);
+				threadlist_addtail(&batch, t);
+			}
+		}
+
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		threadlist_join(&targetcpu->c_runqueue, &batch);
+		if (targetcpu->c_isidle) {
+			/*
+			 * Other processor is idle; send interrupt to make
+			 * sure it unidles.
+			 */
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+
+	threadlist_cleanup(&batch);
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -983,6 +1033,9 @@ wchan_create(const char *name)
 	spinlock_init(&wc->wc_lock);
 	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
+#if OPT_LOCKSTAT
+	wc->wc_stat = lockstat_get(LOCKSTAT_WCHAN, name);
+#endif
 	return wc;
 }
 
@@ -1022,10 +1075,20 @@ wchan_unlock(struct wchan *wc)
 void
 wchan_sleep(struct wchan *wc)
 {
+#if OPT_LOCKSTAT
+	/* wc may be gone by the time we wake up, so grab this now */
+	struct lockstat *ls = wc->wc_stat;
+	uint64_t sleepstart = lockstat_now();
+#endif
+
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
 	thread_switch(S_SLEEP, wc);
+
+#if OPT_LOCKSTAT
+	lockstat_slept(ls, sleepstart);
+#endif
 }
 
 /*
@@ -1059,7 +1122,6 @@ wchan_wakeone(struct wchan *wc)
 void
 wchan_wakeall(struct wchan *wc)
 {
-	struct thread *target;
 	struct threadlist list;
 
 	threadlist_init(&list);
@@ -1069,9 +1131,7 @@ wchan_wakeall(struct wchan *wc)
 	 * private list.
 	 */
 	spinlock_acquire(&wc->wc_lock);
-	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
-		threadlist_addtail(&list, target);
-	}
+	threadlist_join(&list, &wc->wc_threads);
 	/*
 	 * Nobody else can wake up these threads now, so we don't need
 	 * to hang onto the lock.
@@ -1079,13 +1139,10 @@ wchan_wakeall(struct wchan *wc)
 	spinlock_release(&wc->wc_lock);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Hand them to their cpus in batches: one run queue lock and
+	 * at most one IPI per cpu, rather than per thread.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
-	}
+	thread_make_runnable_list(&list);
 
 	threadlist_cleanup(&list);
 }
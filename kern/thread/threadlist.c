@@ -238,3 +238,29 @@ threadlist_remove(struct threadlist *tl, struct thread *t)
 	DEBUGASSERT(tl->tl_count > 0);
 	tl->tl_count--;
 }
+
+void
+threadlist_join(struct threadlist *dest, struct threadlist *src)
+{
+	struct threadlistnode *first, *last;
+
+	DEBUGASSERT(dest != NULL);
+	DEBUGASSERT(src != NULL);
+
+	if (threadlist_isempty(src)) {
+		return;
+	}
+
+	first = src->tl_head.tln_next;
+	last = src->tl_tail.tln_prev;
+
+	first->tln_prev = dest->tl_tail.tln_prev;
+	first->tln_prev->tln_next = first;
+	last->tln_next = &dest->tl_tail;
+	dest->tl_tail.tln_prev = last;
+	dest->tl_count += src->tl_count;
+
+	src->tl_head.tln_next = &src->tl_tail;
+	src->tl_tail.tln_prev = &src->tl_head;
+	src->tl_count = 0;
+}
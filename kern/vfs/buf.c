@@ -0,0 +1,873 @@
+/*
+ * Buffer cache.
+ * The interface is described in buf.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <device.h>
+#include <buf.h>
+
+/* Number of hash chains. */
+#define BUFFER_HASHSIZE    257
+
+/* Number of buffers we allow by default (256K worth). */
+#define BUFFER_DEFAULTMAX  512
+
+/* Default longest time, in seconds, a buffer stays dirty. */
+#define BUFFER_DEFAULTAGE  5
+
+/* Size of the read-ahead request queue. */
+#define BUFFER_RAQUEUE     64
+
+struct buf {
+	struct device *b_dev;		/* device, or NULL if unassigned */
+	uint32_t b_block;		/* block number on b_dev */
+	void *b_data;			/* BUFFER_SIZE bytes */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* pinned */
+	time_t b_dirtytime;		/* when it was first dirtied */
+	struct buf *b_hashnext;		/* hash chain, if b_dev is set */
+	struct buf *b_lruprev;		/* LRU list, if not busy */
+	struct buf *b_lrunext;
+};
+
+/*
+ * buffer_lock protects the hash chains, the LRU list, and the fields of
+ * buffers that aren't busy. A busy buffer's data and flags belong to
+ * whoever pinned it. Busy buffers are never moved to another block, so
+ * the identity of a busy buffer can be checked with just the lock.
+ *
+ * buffer_cv is broadcast whenever a buffer is unpinned or moved.
+ */
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead;	/* least recently used */
+static struct buf *buffer_lrutail;	/* most recently used */
+static unsigned buffer_count;		/* buffers allocated */
+static unsigned buffer_max;		/* buffers allowed */
+static volatile unsigned buffer_maxage;	/* seconds dirty before flushing */
+
+/*
+ * Read-ahead requests, waiting for the reader thread. Also protected
+ * by buffer_lock; buffer_racv is signalled when one is added.
+ */
+struct buffer_rareq {
+	struct device *rr_dev;		/* NULL if cancelled */
+	uint32_t rr_block;
+};
+static struct buffer_rareq buffer_raqueue[BUFFER_RAQUEUE];
+static unsigned buffer_rahead;		/* oldest request */
+static unsigned buffer_racount;		/* requests queued */
+static struct cv *buffer_racv;
+static bool buffer_raenabled;
+
+/*
+ * Statistics. The I/O counts are updated without the lock and so may be
+ * slightly off.
+ */
+static unsigned buffer_hits;
+static unsigned buffer_misses;
+static unsigned buffer_evictions;
+static unsigned buffer_reads;
+static unsigned buffer_writes;
+static unsigned buffer_flushed;
+static unsigned buffer_prefetched;
+
+static void buffer_flusher(void *, unsigned long);
+static void buffer_reader(void *, unsigned long);
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: lock_create failed\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: cv_create failed\n");
+	}
+	buffer_racv = cv_create("buffer readahead");
+	if (buffer_racv == NULL) {
+		panic("buffer_bootstrap: cv_create failed\n");
+	}
+	buffer_max = BUFFER_DEFAULTMAX;
+	buffer_maxage = BUFFER_DEFAULTAGE;
+	buffer_raenabled = true;
+
+	result = thread_fork("bufflush", NULL, buffer_flusher, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("bufread", NULL, buffer_reader, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Hash and LRU list. These all need buffer_lock.
+
+static
+unsigned
+buffer_hashfunc(struct device *dev, uint32_t block)
+{
+	return (((uintptr_t)dev >> 4) ^ block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_find(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	b = buffer_hash[buffer_hashfunc(dev, block)];
+	while (b != NULL && (b->b_dev != dev || b->b_block != block)) {
+		b = b->b_hashnext;
+	}
+	return b;
+}
+
+static
+void
+buffer_hashinsert(struct buf *b)
+{
+	unsigned h;
+
+	h = buffer_hashfunc(b->b_dev, b->b_block);
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+static
+void
+buffer_hashremove(struct buf *b)
+{
+	struct buf **bp;
+
+	bp = &buffer_hash[buffer_hashfunc(b->b_dev, b->b_block)];
+	while (*bp != b) {
+		KASSERT(*bp != NULL);
+		bp = &(*bp)->b_hashnext;
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buffer_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Add to the most recently used end. */
+static
+void
+buffer_lruappend(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+/* Add to the least recently used end, to be reused first. */
+static
+void
+buffer_lruprepend(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	else {
+		buffer_lrutail = b;
+	}
+	buffer_lruhead = b;
+}
+
+/* Forget what block a buffer is for. */
+static
+void
+buffer_disown(struct buf *b)
+{
+	if (b->b_dev != NULL) {
+		buffer_hashremove(b);
+		b->b_dev = NULL;
+	}
+	b->b_valid = false;
+	b->b_dirty = false;
+}
+
+/*
+ * Free clean buffers not in use, least recently used first, until we
+ * are back down to buffer_max. Called wherever buffers come free, so
+ * that after buffer_setmax lowers the limit the cache shrinks as the
+ * buffers it couldn't free right away are written out or let go of.
+ * Must hold buffer_lock.
+ */
+static
+void
+buffer_trim(void)
+{
+	struct buf *b, *next;
+
+	for (b = buffer_lruhead; b != NULL && buffer_count > buffer_max;
+	     b = next) {
+		next = b->b_lrunext;
+		if (b->b_dirty) {
+			continue;
+		}
+		buffer_lruremove(b);
+		buffer_disown(b);
+		kfree(b->b_data);
+		kfree(b);
+		buffer_count--;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Device I/O
+
+/*
+ * Read or write a buffer's block. The buffer must be busy, and
+ * buffer_lock should not be held. I/O errors are retried a few times
+ * before giving up.
+ */
+static
+int
+buffer_devio(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries=0;
+
+	KASSERT(b->b_busy);
+
+	DEBUG(DB_VFS, "buffer: %s %u\n",
+	      rw == UIO_READ ? "read" : "write", b->b_block);
+
+	if (rw == UIO_READ) {
+		buffer_reads++;
+	}
+	else {
+		buffer_writes++;
+	}
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, BUFFER_SIZE,
+		  (off_t)b->b_block * BUFFER_SIZE, rw);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buffer: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buffer: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buffer: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting and releasing buffers
+
+/*
+ * Get a buffer not in use for any block: a new one if we're under the
+ * limit, or else the least recently used one. A dirty victim is written
+ * out first, which means dropping the lock; if that happens, returns
+ * EAGAIN with the victim left free, so the caller can look again for
+ * its block, which may have been loaded meanwhile.
+ */
+static
+int
+buffer_getfree(struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	buffer_trim();
+	if (buffer_count < buffer_max) {
+		b = kmalloc(sizeof(*b));
+		if (b != NULL) {
+			b->b_data = kmalloc(BUFFER_SIZE);
+			if (b->b_data != NULL) {
+				b->b_dev = NULL;
+				b->b_block = 0;
+				b->b_valid = b->b_dirty = false;
+				b->b_busy = false;
+				b->b_hashnext = NULL;
+				b->b_lruprev = b->b_lrunext = NULL;
+				buffer_count++;
+				*ret = b;
+				return 0;
+			}
+			kfree(b);
+		}
+		/* Out of memory; make do with what we have. */
+	}
+
+	b = buffer_lruhead;
+	if (b == NULL) {
+		if (buffer_count == 0) {
+			return ENOMEM;
+		}
+		/* Everything is pinned. Wait for something to come free. */
+		cv_wait(buffer_cv, buffer_lock);
+		return EAGAIN;
+	}
+	buffer_lruremove(b);
+
+	if (b->b_dirty) {
+		b->b_busy = true;
+		lock_release(buffer_lock);
+		result = buffer_devio(b, UIO_WRITE);
+		lock_acquire(buffer_lock);
+		b->b_busy = false;
+		if (result) {
+			buffer_lruappend(b);
+			cv_broadcast(buffer_cv, buffer_lock);
+			return result;
+		}
+		b->b_dirty = false;
+		buffer_evictions++;
+		buffer_disown(b);
+		buffer_lruprepend(b);
+		cv_broadcast(buffer_cv, buffer_lock);
+		return EAGAIN;
+	}
+
+	if (b->b_valid) {
+		buffer_evictions++;
+	}
+	buffer_disown(b);
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Find or set up a buffer for BLOCK on DEV, and pin it. Call with
+ * buffer_lock held; it may be released and reacquired.
+ */
+static
+int
+buffer_acquire(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUFFER_SIZE);
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	while (1) {
+		b = buffer_find(dev, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			buffer_lruremove(b);
+			b->b_busy = true;
+			buffer_hits++;
+			*ret = b;
+			return 0;
+		}
+
+		result = buffer_getfree(&b);
+		if (result == EAGAIN) {
+			continue;
+		}
+		if (result) {
+			return result;
+		}
+
+		b->b_dev = dev;
+		b->b_block = block;
+		b->b_busy = true;
+		buffer_hashinsert(b);
+		buffer_misses++;
+		*ret = b;
+		return 0;
+	}
+}
+
+int
+buffer_get(struct device *dev, uint32_t block, struct buf **ret)
+{
+	int result;
+
+	lock_acquire(buffer_lock);
+	result = buffer_acquire(dev, block, ret);
+	lock_release(buffer_lock);
+	return result;
+}
+
+int
+buffer_read(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_get(dev, block, &b);
+	if (result) {
+		return result;
+	}
+	if (!b->b_valid) {
+		result = buffer_devio(b, UIO_READ);
+		if (result) {
+			buffer_release(b);
+			return result;
+		}
+		b->b_valid = true;
+	}
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+void
+buffer_readahead(struct device *dev, uint32_t block)
+{
+	struct buffer_rareq *rr;
+
+	lock_acquire(buffer_lock);
+	if (buffer_raenabled && buffer_racount < BUFFER_RAQUEUE &&
+	    buffer_find(dev, block) == NULL) {
+		rr = &buffer_raqueue[(buffer_rahead + buffer_racount)
+				     % BUFFER_RAQUEUE];
+		rr->rr_dev = dev;
+		rr->rr_block = block;
+		buffer_racount++;
+		cv_signal(buffer_racv, buffer_lock);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * The reader thread. Reads the requested blocks into the cache, one at
+ * a time, in the order asked for. Someone who wants a block while it's
+ * being read waits for it like for any other pinned buffer.
+ */
+static
+void
+buffer_reader(void *unused1, unsigned long unused2)
+{
+	struct buffer_rareq *rr;
+	struct device *dev;
+	uint32_t block;
+	struct buf *b;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_racount == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		rr = &buffer_raqueue[buffer_rahead];
+		dev = rr->rr_dev;
+		block = rr->rr_block;
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_racount--;
+
+		if (dev == NULL || buffer_find(dev, block) != NULL) {
+			continue;
+		}
+		result = buffer_acquire(dev, block, &b);
+		if (result) {
+			continue;
+		}
+		lock_release(buffer_lock);
+
+		if (!b->b_valid && buffer_devio(b, UIO_READ) == 0) {
+			b->b_valid = true;
+			buffer_prefetched++;
+		}
+		buffer_release(b);
+
+		lock_acquire(buffer_lock);
+	}
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool
+buffer_isvalid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	uint32_t nsecs;
+
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	if (!b->b_dirty) {
+		gettime(&b->b_dirtytime, &nsecs);
+		b->b_dirty = true;
+	}
+}
+
+int
+buffer_sync(struct buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy);
+	if (!b->b_dirty) {
+		return 0;
+	}
+	result = buffer_devio(b, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	b->b_dirty = false;
+	return 0;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	if (b->b_valid) {
+		buffer_lruappend(b);
+	}
+	else {
+		buffer_disown(b);
+		buffer_lruprepend(b);
+	}
+	buffer_trim();
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Whole-device operations
+
+/*
+ * Write out the dirty buffers for DEV, or for every device if DEV is
+ * NULL, that were dirtied at or before CUTOFF. If WAIT is set, buffers
+ * that are pinned are waited for; otherwise they're skipped. Returns
+ * the last error seen; buffers that fail to write stay dirty.
+ */
+static
+int
+buffer_flush(struct device *dev, time_t cutoff, bool wait)
+{
+	struct buf *b;
+	unsigned i;
+	int result, ret;
+
+	ret = 0;
+	lock_acquire(buffer_lock);
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		b = buffer_hash[i];
+		while (b != NULL) {
+			/*
+			 * The flags of a pinned buffer belong to its owner,
+			 * but a stale look at them is good enough here.
+			 */
+			if ((dev != NULL && b->b_dev != dev) || !b->b_dirty ||
+			    b->b_dirtytime > cutoff) {
+				b = b->b_hashnext;
+				continue;
+			}
+			if (b->b_busy && !wait) {
+				b = b->b_hashnext;
+				continue;
+			}
+			if (b->b_busy) {
+				/* Wait for it, then start the chain over. */
+				cv_wait(buffer_cv, buffer_lock);
+				b = buffer_hash[i];
+				continue;
+			}
+
+			/* Being busy keeps it on this chain while we write. */
+			buffer_lruremove(b);
+			b->b_busy = true;
+			lock_release(buffer_lock);
+			result = buffer_devio(b, UIO_WRITE);
+			lock_acquire(buffer_lock);
+			if (result) {
+				ret = result;
+			}
+			else {
+				b->b_dirty = false;
+				buffer_flushed++;
+			}
+			b->b_busy = false;
+			buffer_lruappend(b);
+			cv_broadcast(buffer_cv, buffer_lock);
+			b = b->b_hashnext;
+		}
+	}
+	buffer_trim();
+	lock_release(buffer_lock);
+	return ret;
+}
+
+int
+buffer_sync_dev(struct device *dev)
+{
+	time_t now;
+	uint32_t nsecs;
+
+	gettime(&now, &nsecs);
+	return buffer_flush(dev, now, true);
+}
+
+/*
+ * The flusher thread. Once a second, writes out whatever has been
+ * dirty for longer than buffer_maxage. Write errors are left for the
+ * next pass, or for whoever syncs the device to see.
+ */
+static
+void
+buffer_flusher(void *unused1, unsigned long unused2)
+{
+	time_t now;
+	uint32_t nsecs;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(1);
+		gettime(&now, &nsecs);
+		(void)buffer_flush(NULL, now - buffer_maxage, false);
+	}
+}
+
+void
+buffer_drop(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	while ((b = buffer_find(dev, block)) != NULL && b->b_busy) {
+		/* Probably the flusher; wait for it to finish. */
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL) {
+		buffer_lruremove(b);
+		buffer_disown(b);
+		buffer_lruprepend(b);
+	}
+	lock_release(buffer_lock);
+}
+
+void
+buffer_drop_dev(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i;
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<buffer_racount; i++) {
+		if (buffer_raqueue[(buffer_rahead + i) % BUFFER_RAQUEUE].rr_dev
+		    == dev) {
+			buffer_raqueue[(buffer_rahead + i) % BUFFER_RAQUEUE]
+				.rr_dev = NULL;
+		}
+	}
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		b = buffer_hash[i];
+		while (b != NULL) {
+			next = b->b_hashnext;
+			if (b->b_dev != dev) {
+				b = next;
+				continue;
+			}
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				b = buffer_hash[i];
+				continue;
+			}
+			buffer_lruremove(b);
+			buffer_disown(b);
+			buffer_lruprepend(b);
+			b = next;
+		}
+	}
+	lock_release(buffer_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Tuning and statistics
+
+/*
+ * Set the number of buffers. If this is fewer than we have, dirty
+ * buffers not in use are written out and the extra clean ones freed
+ * now; buffer_trim gets the rest as they come free.
+ */
+int
+buffer_setmax(unsigned max)
+{
+	time_t now;
+	uint32_t nsecs;
+
+	if (max < BUFFER_MINMAX) {
+		return EINVAL;
+	}
+
+	lock_acquire(buffer_lock);
+	buffer_max = max;
+	lock_release(buffer_lock);
+
+	/* This trims as it finishes. Write errors are left for later. */
+	gettime(&now, &nsecs);
+	(void)buffer_flush(NULL, now, false);
+	return 0;
+}
+
+void
+buffer_setmaxage(unsigned secs)
+{
+	buffer_maxage = secs;
+}
+
+bool
+buffer_setreadahead(bool on)
+{
+	bool old;
+
+	lock_acquire(buffer_lock);
+	old = buffer_raenabled;
+	buffer_raenabled = on;
+	lock_release(buffer_lock);
+	return old;
+}
+
+int
+buffer_purge(void)
+{
+	struct buf *b, *next;
+	time_t now;
+	uint32_t nsecs;
+	unsigned i;
+	int result;
+
+	gettime(&now, &nsecs);
+	result = buffer_flush(NULL, now, true);
+
+	lock_acquire(buffer_lock);
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		for (b = buffer_hash[i]; b != NULL; b = next) {
+			next = b->b_hashnext;
+			if (!b->b_busy && !b->b_dirty) {
+				buffer_lruremove(b);
+				buffer_disown(b);
+				buffer_lruprepend(b);
+			}
+		}
+	}
+	lock_release(buffer_lock);
+	return result;
+}
+
+void
+buffer_printstats(void)
+{
+	struct buf *b;
+	unsigned i, dirty, busy;
+
+	lock_acquire(buffer_lock);
+	dirty = busy = 0;
+	for (i=0; i<BUFFER_HASHSIZE; i++) {
+		for (b = buffer_hash[i]; b != NULL; b = b->b_hashnext) {
+			if (b->b_busy) {
+				busy++;
+			}
+			else if (b->b_dirty) {
+				dirty++;
+			}
+		}
+	}
+	kprintf("Buffers: %u of %u in use, %u dirty, %u pinned\n",
+		buffer_count, buffer_max, dirty, busy);
+	kprintf("Lookups: %u hits, %u misses, %u evictions\n",
+		buffer_hits, buffer_misses, buffer_evictions);
+	kprintf("Disk I/O: %u reads, %u writes (%u by sync or flusher)\n",
+		buffer_reads, buffer_writes, buffer_flushed);
+	kprintf("Read-ahead: %s, %u blocks read ahead\n",
+		buffer_raenabled ? "on" : "off", buffer_prefetched);
+	kprintf("Dirty buffers are flushed after %u seconds\n",
+		buffer_maxage);
+	lock_release(buffer_lock);
+}
@@ -0,0 +1,367 @@
+/*
+ * Name lookup cache.
+ * The interface is described in dcache.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <dcache.h>
+
+/* Number of entries. */
+#define DCACHE_SIZE      256
+
+/* Number of hash chains. */
+#define DCACHE_HASHSIZE  257
+
+/* Longest name cached, including the terminating null. */
+#define DCACHE_NAMELEN   32
+
+struct dcentry {
+	struct vnode *de_dir;		/* directory looked in */
+	struct vnode *de_vn;		/* what was found, or NULL if nothing */
+	char de_name[DCACHE_NAMELEN];	/* name looked up */
+	struct dcentry *de_next;	/* hash chain, or free/dead list */
+	struct dcentry *de_lruprev;	/* LRU list, if in the cache */
+	struct dcentry *de_lrunext;
+};
+
+/*
+ * dcache_spinlock protects everything here. Vnode references are
+ * only ever added while holding it; they are dropped after letting
+ * go of it, since dropping the last one calls into the filesystem.
+ * Entries on their way out are on nobody's list until then.
+ */
+static struct spinlock dcache_spinlock = SPINLOCK_INITIALIZER;
+static struct dcentry dcache_entries[DCACHE_SIZE];
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_free;
+static struct dcentry *dcache_lruhead;	/* least recently used */
+static struct dcentry *dcache_lrutail;	/* most recently used */
+
+/* Bumped whenever anything is invalidated. */
+static unsigned dcache_gen;
+
+/* Statistics. */
+static unsigned dcache_hits;
+static unsigned dcache_neghits;
+static unsigned dcache_misses;
+static unsigned dcache_evictions;
+static unsigned dcache_invalidations;
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache_free = NULL;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		dcache_entries[i].de_dir = NULL;
+		dcache_entries[i].de_vn = NULL;
+		dcache_entries[i].de_next = dcache_free;
+		dcache_free = &dcache_entries[i];
+	}
+	dcache_lruhead = dcache_lrutail = NULL;
+	dcache_gen = 0;
+}
+
+/*
+ * Whether a lookup of NAME in DIR may be cached. Device vnodes have
+ * no fs; names with slashes in them are walked by the filesystem, and
+ * invalidation only ever sees the last component.
+ */
+static
+bool
+dcache_cacheable(struct vnode *dir, const char *name)
+{
+	return dir->vn_fs != NULL && strlen(name) < DCACHE_NAMELEN &&
+		strchr(name, '/') == NULL;
+}
+
+static
+unsigned
+dcache_hashfunc(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (unsigned)(uintptr_t)dir >> 4;
+	while (*name != 0) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+/*
+ * Find the entry for NAME in DIR. Must hold dcache_spinlock.
+ */
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *de;
+
+	for (de = dcache_hash[dcache_hashfunc(dir, name)]; de != NULL;
+	     de = de->de_next) {
+		if (de->de_dir == dir && !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_lru_remove(struct dcentry *de)
+{
+	if (de->de_lruprev != NULL) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		dcache_lruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext != NULL) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		dcache_lrutail = de->de_lruprev;
+	}
+	de->de_lruprev = de->de_lrunext = NULL;
+}
+
+static
+void
+dcache_lru_append(struct dcentry *de)
+{
+	de->de_lruprev = dcache_lrutail;
+	de->de_lrunext = NULL;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->de_lrunext = de;
+	}
+	else {
+		dcache_lruhead = de;
+	}
+	dcache_lrutail = de;
+}
+
+/*
+ * Take an entry out of the cache and put it on the list DEAD, for
+ * dcache_bury. Must hold dcache_spinlock.
+ */
+static
+void
+dcache_unlink(struct dcentry *de, struct dcentry **dead)
+{
+	struct dcentry **pp;
+
+	pp = &dcache_hash[dcache_hashfunc(de->de_dir, de->de_name)];
+	while (*pp != de) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->de_next;
+	}
+	*pp = de->de_next;
+	dcache_lru_remove(de);
+
+	de->de_next = *dead;
+	*dead = de;
+}
+
+/*
+ * Drop the references held by the entries on DEAD and put them back
+ * on the free list. Must not hold dcache_spinlock.
+ */
+static
+void
+dcache_bury(struct dcentry *dead)
+{
+	struct dcentry *de, *next;
+
+	for (de = dead; de != NULL; de = de->de_next) {
+		VOP_DECREF(de->de_dir);
+		if (de->de_vn != NULL) {
+			VOP_DECREF(de->de_vn);
+		}
+	}
+
+	spinlock_acquire(&dcache_spinlock);
+	for (de = dead; de != NULL; de = next) {
+		next = de->de_next;
+		de->de_dir = NULL;
+		de->de_vn = NULL;
+		de->de_next = dcache_free;
+		dcache_free = de;
+	}
+	spinlock_release(&dcache_spinlock);
+}
+
+bool
+dcache_lookup(struct vnode *dir, const char *name,
+	      struct vnode **ret, unsigned *gen)
+{
+	struct dcentry *de;
+
+	if (!dcache_cacheable(dir, name)) {
+		*gen = 0;
+		return false;
+	}
+
+	spinlock_acquire(&dcache_spinlock);
+	de = dcache_find(dir, name);
+	if (de == NULL) {
+		dcache_misses++;
+		*gen = dcache_gen;
+		spinlock_release(&dcache_spinlock);
+		return false;
+	}
+
+	dcache_lru_remove(de);
+	dcache_lru_append(de);
+	if (de->de_vn != NULL) {
+		VOP_INCREF(de->de_vn);
+		dcache_hits++;
+	}
+	else {
+		dcache_neghits++;
+	}
+	*ret = de->de_vn;
+	spinlock_release(&dcache_spinlock);
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+	     unsigned gen)
+{
+	struct dcentry *de, *dead;
+	unsigned h;
+
+	if (!dcache_cacheable(dir, name)) {
+		return;
+	}
+
+	spinlock_acquire(&dcache_spinlock);
+	while (1) {
+		if (gen != dcache_gen || dcache_find(dir, name) != NULL) {
+			/* Stale, or someone else got here first. */
+			spinlock_release(&dcache_spinlock);
+			return;
+		}
+		if (dcache_free != NULL) {
+			break;
+		}
+
+		/*
+		 * Make room. The victim's references have to be dropped
+		 * without the spinlock, so look again afterwards.
+		 */
+		KASSERT(dcache_lruhead != NULL);
+		dead = NULL;
+		dcache_unlink(dcache_lruhead, &dead);
+		dcache_evictions++;
+		spinlock_release(&dcache_spinlock);
+		dcache_bury(dead);
+		spinlock_acquire(&dcache_spinlock);
+	}
+	de = dcache_free;
+	dcache_free = de->de_next;
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	de->de_dir = dir;
+	de->de_vn = vn;
+	strcpy(de->de_name, name);
+	h = dcache_hashfunc(dir, name);
+	de->de_next = dcache_hash[h];
+	dcache_hash[h] = de;
+	dcache_lru_append(de);
+	spinlock_release(&dcache_spinlock);
+}
+
+void
+dcache_invalidate(struct vnode *dir, const char *name)
+{
+	struct dcentry *de, *next, *dead;
+	struct vnode *vn;
+
+	if (!dcache_cacheable(dir, name)) {
+		return;
+	}
+
+	dead = NULL;
+	spinlock_acquire(&dcache_spinlock);
+	dcache_gen++;
+	de = dcache_find(dir, name);
+	if (de != NULL) {
+		vn = de->de_vn;
+		dcache_unlink(de, &dead);
+		dcache_invalidations++;
+
+		/*
+		 * If it was a directory, it may have been removed, and
+		 * the names in it with it. We don't know the type, so
+		 * check for names cached in it regardless; the cache
+		 * is small.
+		 */
+		if (vn != NULL) {
+			for (de = dcache_lruhead; de != NULL; de = next) {
+				next = de->de_lrunext;
+				if (de->de_dir == vn) {
+					dcache_unlink(de, &dead);
+				}
+			}
+		}
+	}
+	spinlock_release(&dcache_spinlock);
+
+	if (dead != NULL) {
+		dcache_bury(dead);
+	}
+}
+
+void
+dcache_purge_fs(struct fs *fs)
+{
+	struct dcentry *de, *next, *dead;
+
+	dead = NULL;
+	spinlock_acquire(&dcache_spinlock);
+	dcache_gen++;
+	for (de = dcache_lruhead; de != NULL; de = next) {
+		next = de->de_lrunext;
+		if (de->de_dir->vn_fs == fs) {
+			dcache_unlink(de, &dead);
+		}
+	}
+	spinlock_release(&dcache_spinlock);
+
+	if (dead != NULL) {
+		dcache_bury(dead);
+	}
+}
+
+void
+dcache_printstats(void)
+{
+	struct dcentry *de;
+	unsigned count, negative;
+
+	count = negative = 0;
+	spinlock_acquire(&dcache_spinlock);
+	for (de = dcache_lruhead; de != NULL; de = de->de_lrunext) {
+		count++;
+		if (de->de_vn == NULL) {
+			negative++;
+		}
+	}
+	spinlock_release(&dcache_spinlock);
+
+	/* kprintf may sleep, so not under the spinlock. */
+	kprintf("Names: %u of %u cached, %u negative\n",
+		count, DCACHE_SIZE, negative);
+	kprintf("Lookups: %u hits, %u negative hits, %u misses\n",
+		dcache_hits, dcache_neghits, dcache_misses);
+	kprintf("%u evictions, %u invalidations\n",
+		dcache_evictions, dcache_invalidations);
+}
@@ -43,6 +43,8 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
 
 /*
  * Structure for a single named device.
@@ -110,6 +112,8 @@ vfs_bootstrap(void)
 	vfs_biglock_depth = 0;
 
 	devnull_create();
+	buffer_bootstrap();
+	dcache_bootstrap();
 }
 
 /*
@@ -571,6 +575,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* The name cache holds references to vnodes; let them go. */
+	dcache_purge_fs(kd->kd_fs);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -619,6 +626,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		dcache_purge_fs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -39,6 +39,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <dcache.h>
 
 static struct vnode *bootfs_vnode = NULL;
 
@@ -235,11 +236,15 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
+	/*
+	 * The big lock is only needed to find the starting point. Our
+	 * reference keeps that from being unmounted, and the
+	 * filesystem does its own locking from there.
+	 */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -257,7 +262,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -265,25 +269,35 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	unsigned gen;
 	int result;
 
+	/* As in vfs_lookparent, only getdevice needs the big lock. */
 	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	if (dcache_lookup(startvn, path, retval, &gen)) {
+		result = (*retval == NULL) ? ENOENT : 0;
+	}
+	else {
+		result = VOP_LOOKUP(startvn, path, retval);
+		if (result == 0) {
+			dcache_enter(startvn, path, *retval, gen);
+		}
+		else if (result == ENOENT) {
+			dcache_enter(startvn, path, NULL, gen);
+		}
+	}
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
@@ -29,6 +29,10 @@
 
 /*
  * High-level VFS operations on pathnames.
+ *
+ * Whatever changes a directory has to tell the name cache (dcache.h)
+ * about the names it touched, once the change has been made. It does
+ * so even on failure, in case the filesystem got part way.
  */
 
 #include <types.h>
@@ -38,6 +42,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <dcache.h>
 
 
 /* Does most of the work for open(). */
@@ -74,6 +79,7 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		dcache_invalidate(dir, name);
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +156,7 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	dcache_invalidate(dir, name);
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +190,8 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	dcache_invalidate(olddir, oldname);
+	dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +226,7 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	dcache_invalidate(newdir, newname);
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +254,7 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	dcache_invalidate(newdir, newname);
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +301,7 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	dcache_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -312,6 +324,7 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	dcache_invalidate(parent, name);
 
 	VOP_DECREF(parent);
 
@@ -142,12 +142,72 @@ copycheck(const_userptr_t userptr, size_t len, size_t *stoplen)
 	return 0;
 }
 
+/* True if the 32-bit word W has a zero byte in it. */
+#define HASZERO(w) ((((w) - 0x01010101U) & ~(w) & 0x80808080U) != 0)
+
+/*
+ * Block copy used by copyin and copyout. When source and destination
+ * are aligned alike, copies a byte at a time up to a word boundary,
+ * then eight words per loop iteration, then the leftover words and
+ * bytes. Otherwise there's nothing better to do than memcpy.
+ *
+ * This is ordinary C, so a fault partway through ends up in copyfail
+ * just as it would from memcpy.
+ */
+static
+void
+copyblock(void *dest, const void *src, size_t len)
+{
+	char *d = dest;
+	const char *s = src;
+	uint32_t *dw;
+	const uint32_t *sw;
+
+	if (len < 8 * sizeof(uint32_t) ||
+	    ((uintptr_t)d ^ (uintptr_t)s) % sizeof(uint32_t) != 0) {
+		memcpy(dest, src, len);
+		return;
+	}
+
+	while ((uintptr_t)d % sizeof(uint32_t) != 0) {
+		*d++ = *s++;
+		len--;
+	}
+
+	dw = (uint32_t *)d;
+	sw = (const uint32_t *)s;
+	while (len >= 8 * sizeof(uint32_t)) {
+		dw[0] = sw[0];
+		dw[1] = sw[1];
+		dw[2] = sw[2];
+		dw[3] = sw[3];
+		dw[4] = sw[4];
+		dw[5] = sw[5];
+		dw[6] = sw[6];
+		dw[7] = sw[7];
+		dw += 8;
+		sw += 8;
+		len -= 8 * sizeof(uint32_t);
+	}
+	while (len >= sizeof(uint32_t)) {
+		*dw++ = *sw++;
+		len -= sizeof(uint32_t);
+	}
+
+	d = (char *)dw;
+	s = (const char *)sw;
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
+	}
+}
+
 /*
  * copyin
  *
  * Copy a block of memory of length LEN from user-level address USERSRC 
- * to kernel address DEST. We can use memcpy because it's protected by
- * the tm_badfaultfunc/copyfail logic.
+ * to kernel address DEST. We can use copyblock because it's protected
+ * by the tm_badfaultfunc/copyfail logic.
  */
 int
 copyin(const_userptr_t usersrc, void *dest, size_t len)
@@ -172,7 +232,7 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
 		return EFAULT;
 	}
 
-	memcpy(dest, (const void *)usersrc, len);
+	copyblock(dest, (const void *)usersrc, len);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return 0;
@@ -182,7 +242,7 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
  * copyout
  *
  * Copy a block of memory of length LEN from kernel address SRC to
- * user-level address USERDEST. We can use memcpy because it's
+ * user-level address USERDEST. We can use copyblock because it's
  * protected by the tm_badfaultfunc/copyfail logic.
  */
 int
@@ -208,7 +268,7 @@ copyout(const void *src, userptr_t userdest, size_t len)
 		return EFAULT;
 	}
 
-	memcpy((void *)userdest, src, len);
+	copyblock((void *)userdest, src, len);
 
 	curthread->t_machdep.tm_badfaultfunc = NULL;
 	return 0;
@@ -229,15 +289,40 @@ copyout(const void *src, userptr_t userdest, size_t len)
  * hit STOPLEN it's because the string has run into the end of
  * userspace. Thus in the latter case we return EFAULT, not 
  * ENAMETOOLONG.
+ *
+ * When SRC and DEST are aligned alike, the bulk of the string is
+ * copied a word at a time, stopping at the first word that contains
+ * the null; the byte loop then finishes up from there.
  */
 static
 int
 copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
 	size_t *gotlen)
 {
-	size_t i;
+	size_t i, limit;
+	uint32_t w;
+
+	limit = maxlen < stoplen ? maxlen : stoplen;
+	i = 0;
+
+	if (((uintptr_t)dest ^ (uintptr_t)src) % sizeof(uint32_t) == 0) {
+		while (i < limit && (uintptr_t)(src + i) % sizeof(uint32_t) != 0
+		       && src[i] != 0) {
+			dest[i] = src[i];
+			i++;
+		}
+		while (i + sizeof(uint32_t) <= limit &&
+		       (uintptr_t)(src + i) % sizeof(uint32_t) == 0) {
+			w = *(const uint32_t *)(src + i);
+			if (HASZERO(w)) {
+				break;
+			}
+			*(uint32_t *)(dest + i) = w;
+			i += sizeof(uint32_t);
+		}
+	}
 
-	for (i=0; i<maxlen && i<stoplen; i++) {
+	for (; i<limit; i++) {
 		dest[i] = src[i];
 		if (src[i] == 0) {
 			if (gotlen != NULL) {